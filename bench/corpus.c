@@ -0,0 +1,485 @@
+// © 2021 Vlad-Stefan Harbuz <vlad@vladh.net>
+// SPDX-License-Identifier: blessing
+
+// Makes a synthetic source folder to benchmark fotografiska with, made up of:
+//
+// * JPEGs with an EXIF date
+// * JPEGs without one, which get their date from their modification time
+// * big fake MP4 videos with a creation time, whose data is mostly a hole in the file,
+//   so they're big without taking up much space
+// * tiny sidecar files of up to 4KB
+// * copies of other files under a different name, which are duplicates
+//
+// Some of the files also get a copy in the destination folder, under the name
+// fotografiska will want to give them (hashed the way --hash says), so that they collide.
+//
+// Usage: bench_corpus [options] SRC_DIR DEST_DIR
+//
+// The same options always give the same files, with the same modification times, so
+// runs can be compared with each other. SRC_DIR and DEST_DIR are created if they don't
+// exist, and shouldn't have anything else in them.
+
+#define FOTOGRAFISKA_NO_MAIN
+#include "../fotografiska.c"
+
+
+// The random data we put after the headers of each video
+static size_t const CORPUS_VIDEO_DATA_SIZE = KB_TO_B(256);
+static size_t const CORPUS_MAX_TINY_SIZE = KB_TO_B(4);
+static size_t const CORPUS_MIN_JPEG_SIZE = KB_TO_B(8);
+// Files are dated somewhere between 2015-01-01 and 2024-12-31
+static int64_t const CORPUS_FIRST_DATE = 1420070400;
+static int64_t const CORPUS_DATE_RANGE = 10LL * 365 * 24 * 60 * 60;
+
+
+enum corpus_file_kind {
+    CORPUS_EXIF_JPEG,
+    CORPUS_PLAIN_JPEG,
+    CORPUS_VIDEO,
+    CORPUS_TINY,
+    CORPUS_COPY,
+    N_CORPUS_FILE_KINDS,
+};
+
+static char const * const CORPUS_FILE_KIND_NAMES[] = {
+    "EXIF JPEGs", "plain JPEGs", "videos", "tiny files", "copies",
+};
+
+
+/*!
+  These are `int`s and strings so that argparse can fill them in, see `CORPUS_OPTIONS`.
+  */
+struct corpus_options {
+    int n_files;
+    int seed;
+    int max_jpeg_kb;
+    int video_mb;
+    int collision_percent;
+    char const *hash_name;
+};
+
+/*!
+  One file in the corpus. `data` is what's actually written, and the file is then made
+  `size` bytes big, which is only bigger for videos.
+  */
+struct corpus_file {
+    enum corpus_file_kind kind;
+    char name[64];
+    uint8_t *data;
+    size_t data_size;
+    size_t size;
+    time_t mtime;
+};
+
+struct corpus {
+    struct corpus_options options;
+    enum hash_kind hash_kind;
+    size_t n_files_of_kind[N_CORPUS_FILE_KINDS];
+    size_t n_collisions;
+    uint64_t n_bytes;
+    // Big enough for any file we make
+    uint8_t *buffer;
+    char *plan_buffer;
+};
+
+
+static struct corpus_options
+get_default_corpus_options(void)
+{
+    return (struct corpus_options){
+        .n_files = 10000,
+        .seed = 1,
+        .max_jpeg_kb = 64,
+        .video_mb = 64,
+        .collision_percent = 2,
+        .hash_name = HASH_KIND_NAMES[HASH_XXH64],
+    };
+}
+
+
+/*!
+  Adds the options for making a corpus to an argparse option list.
+  */
+#define CORPUS_OPTIONS(Options) \
+    OPT_INTEGER('n', "files", &(Options)->n_files, "how many files to make (default 10000)"), \
+    OPT_INTEGER(0, "seed", &(Options)->seed, "change this to get different files (default 1)"), \
+    OPT_INTEGER(0, "jpeg-kb", &(Options)->max_jpeg_kb, "how big JPEGs can be, in KB (default 64, at least 8)"), \
+    OPT_INTEGER(0, "video-mb", &(Options)->video_mb, "how big videos are, in MB, mostly as a hole in the file (default 64)"), \
+    OPT_INTEGER(0, "collisions", &(Options)->collision_percent, "what percentage of files to put a copy of in the destination folder (default 2)"), \
+    OPT_STRING(0, "hash", &(Options)->hash_name, "how fotografiska will hash files, so that the copies get the right names (default xxh64)")
+
+
+static bool
+are_corpus_options_valid(struct corpus_options const *options)
+{
+    enum hash_kind hash_kind;
+    return options->n_files >= 0 && options->max_jpeg_kb >= 8 && options->video_mb >= 1 &&
+        options->collision_percent >= 0 && options->collision_percent <= 100 &&
+        parse_hash_kind(options->hash_name, &hash_kind);
+}
+
+
+/*!
+  splitmix64, which is plenty random for making up files.
+  */
+static uint64_t
+get_next_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+static void
+fill_random(uint64_t *state, uint8_t *data, size_t const size)
+{
+    size_t idx = 0;
+    for (; idx + 8 <= size; idx += 8) {
+        uint64_t const value = get_next_random(state);
+        memcpy(data + idx, &value, 8);
+    }
+    uint64_t const value = get_next_random(state);
+    memcpy(data + idx, &value, size - idx);
+}
+
+
+static void
+write_u16_be(uint8_t *data, uint16_t const value)
+{
+    data[0] = (uint8_t)(value >> 8);
+    data[1] = (uint8_t)value;
+}
+
+
+static void
+write_u32_be(uint8_t *data, uint32_t const value)
+{
+    write_u16_be(data, (uint16_t)(value >> 16));
+    write_u16_be(data + 2, (uint16_t)value);
+}
+
+
+/*!
+  Makes a JPEG that is `size` bytes big. If `exif_date` isn't NULL, it's put in an
+  EXIF DateTime tag. The image data is just random bytes, since we never look at it.
+  */
+static size_t
+make_jpeg(uint64_t *state, uint8_t *data, size_t const size, char const *exif_date)
+{
+    size_t pos = 0;
+    data[pos++] = 0xFF;
+    data[pos++] = 0xD8;
+
+    if (exif_date) {
+        // APP1 with a little-endian TIFF structure, with one IFD with one entry
+        static uint8_t const tiff_header[] = {
+            'E', 'x', 'i', 'f', 0, 0,
+            'I', 'I', 42, 0, 8, 0, 0, 0,
+            // 1 entry: DateTime, ASCII, 20 bytes, at offset 26
+            1, 0,
+            0x32, 0x01, 2, 0, 20, 0, 0, 0, 26, 0, 0, 0,
+            // No next IFD
+            0, 0, 0, 0,
+        };
+        data[pos++] = 0xFF;
+        data[pos++] = 0xE1;
+        write_u16_be(data + pos, (uint16_t)(2 + sizeof(tiff_header) + 20));
+        pos += 2;
+        memcpy(data + pos, tiff_header, sizeof(tiff_header));
+        pos += sizeof(tiff_header);
+        memcpy(data + pos, exif_date, 20);
+        pos += 20;
+    } else {
+        static uint8_t const jfif_header[] = {
+            0xFF, 0xE0, 0, 16, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0,
+        };
+        memcpy(data + pos, jfif_header, sizeof(jfif_header));
+        pos += sizeof(jfif_header);
+    }
+
+    // Start of scan, then "image data" until the end of image marker
+    data[pos++] = 0xFF;
+    data[pos++] = 0xDA;
+    fill_random(state, data + pos, size - pos - 2);
+    data[size - 2] = 0xFF;
+    data[size - 1] = 0xD9;
+    return size;
+}
+
+
+/*!
+  Makes the start of an MP4 with a movie header that says it was made at `unix_time`,
+  followed by an "mdat" box that takes up the rest of the `file_size` bytes.
+  */
+static size_t
+make_video(uint64_t *state, uint8_t *data, size_t const file_size, int64_t const unix_time)
+{
+    uint64_t const SECONDS_FROM_1904_TO_1970 = 2082844800ULL;
+    size_t pos = 0;
+
+    static uint8_t const ftyp[] = {
+        0, 0, 0, 20, 'f', 't', 'y', 'p', 'i', 's', 'o', 'm', 0, 0, 2, 0, 'i', 's', 'o', 'm',
+    };
+    memcpy(data + pos, ftyp, sizeof(ftyp));
+    pos += sizeof(ftyp);
+
+    // A version 0 mvhd is 100 bytes, of which we only fill in the creation time
+    write_u32_be(data + pos, 8 + 8 + 100);
+    memcpy(data + pos + 4, "moov", 4);
+    write_u32_be(data + pos + 8, 8 + 100);
+    memcpy(data + pos + 12, "mvhd", 4);
+    pos += 16;
+    memset(data + pos, 0, 100);
+    write_u32_be(data + pos + 4, (uint32_t)(unix_time + SECONDS_FROM_1904_TO_1970));
+    pos += 100;
+
+    // A 64-bit mdat header, so that videos can be bigger than 4GB
+    write_u32_be(data + pos, 1);
+    memcpy(data + pos + 4, "mdat", 4);
+    write_u32_be(data + pos + 8, (uint32_t)((uint64_t)(file_size - pos) >> 32));
+    write_u32_be(data + pos + 12, (uint32_t)(file_size - pos));
+    pos += 16;
+
+    fill_random(state, data + pos, CORPUS_VIDEO_DATA_SIZE);
+    return pos + CORPUS_VIDEO_DATA_SIZE;
+}
+
+
+/*!
+  Works out everything about file `idx` of the corpus and makes its contents in
+  `corpus->buffer`. Each file only depends on the seed and its index, so we can make
+  any file again to copy it.
+  */
+static void
+make_corpus_file(struct corpus *corpus, size_t const idx, struct corpus_file *file)
+{
+    struct corpus_options const *options = &corpus->options;
+    uint64_t state = XXH64(&idx, sizeof(idx), (uint64_t)options->seed);
+
+    uint64_t const kind_roll = get_next_random(&state) % 100;
+    file->kind = kind_roll < 55 ? CORPUS_EXIF_JPEG :
+        kind_roll < 70 ? CORPUS_PLAIN_JPEG :
+        kind_roll < 72 ? CORPUS_VIDEO :
+        kind_roll < 95 ? CORPUS_TINY :
+        idx > 0 ? CORPUS_COPY : CORPUS_PLAIN_JPEG;
+    int64_t const unix_time = CORPUS_FIRST_DATE +
+        (int64_t)(get_next_random(&state) % CORPUS_DATE_RANGE);
+    file->mtime = (time_t)unix_time;
+    file->data = corpus->buffer;
+
+    if (file->kind == CORPUS_COPY) {
+        // Copy the contents of an earlier file, but keep our own name and mtime
+        struct corpus_file original;
+        make_corpus_file(corpus, (size_t)(get_next_random(&state) % idx), &original);
+        snprintf(file->name, sizeof(file->name), "CPY_%07zu%s", idx,
+            strrchr(original.name, '.'));
+        file->data_size = original.data_size;
+        file->size = original.size;
+        return;
+    }
+
+    if (file->kind == CORPUS_EXIF_JPEG || file->kind == CORPUS_PLAIN_JPEG) {
+        size_t const size_range = KB_TO_B((size_t)options->max_jpeg_kb) - CORPUS_MIN_JPEG_SIZE;
+        size_t const size = CORPUS_MIN_JPEG_SIZE +
+            (size_t)(get_next_random(&state) % (size_range + 1));
+        char exif_date[20] = {};
+        if (file->kind == CORPUS_EXIF_JPEG) {
+            struct tm date_tm = {};
+            gmtime_r(&file->mtime, &date_tm);
+            strftime(exif_date, sizeof(exif_date), "%Y:%m:%d %H:%M:%S", &date_tm);
+            // Cameras don't set the modification time to when the photo was taken
+            file->mtime += (time_t)(get_next_random(&state) % (365 * 24 * 60 * 60));
+        }
+        snprintf(file->name, sizeof(file->name), "IMG_%07zu.JPG", idx);
+        file->data_size = make_jpeg(&state, file->data, size,
+            file->kind == CORPUS_EXIF_JPEG ? exif_date : NULL);
+        file->size = file->data_size;
+    } else if (file->kind == CORPUS_VIDEO) {
+        snprintf(file->name, sizeof(file->name), "MVI_%07zu.MP4", idx);
+        file->size = MB_TO_B((size_t)options->video_mb);
+        file->data_size = make_video(&state, file->data, file->size, unix_time);
+    } else {
+        snprintf(file->name, sizeof(file->name), "IMG_%07zu.XMP", idx);
+        file->data_size = (size_t)(get_next_random(&state) % (CORPUS_MAX_TINY_SIZE + 1));
+        fill_random(&state, file->data, file->data_size);
+        file->size = file->data_size;
+    }
+}
+
+
+/*!
+  Writes `file` to `path`, and gives it its modification time.
+  */
+static bool
+write_corpus_file(struct corpus_file const *file, char const *path)
+{
+    int const fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    size_t n_written = 0;
+    while (n_written < file->data_size) {
+        ssize_t const n_written_now = write(fd, file->data + n_written,
+            file->data_size - n_written);
+        if (n_written_now <= 0) {
+            close(fd);
+            return false;
+        }
+        n_written += n_written_now;
+    }
+    // The rest of a video is left as a hole, so it doesn't take up any space
+    bool const could_resize = file->size == file->data_size ||
+        ftruncate(fd, (off_t)file->size) == 0;
+    close(fd);
+
+    struct timespec const times[2] = {
+        {.tv_sec = file->mtime}, {.tv_sec = file->mtime},
+    };
+    return could_resize && utimensat(AT_FDCWD, path, times, 0) == 0;
+}
+
+
+/*!
+  Puts a copy of the file at `path` where fotografiska will want to move it in
+  `dest_dir`, so that it finds a file already there.
+  */
+static bool
+make_collision(struct corpus *corpus, struct corpus_file const *file, char const *path,
+    char const *dest_dir
+) {
+    tinydir_file src_file;
+    if (tinydir_file_open(&src_file, path) != 0) {
+        return false;
+    }
+    struct run const run = {.hash_kind = corpus->hash_kind};
+    struct file_plan plan = {};
+    if (!plan_file_move(&run, &src_file, &corpus->plan_buffer, &plan)) {
+        return false;
+    }
+
+    char target_path[MAX_PATH] = {};
+    if (!pstr_vcat(target_path, sizeof(target_path), dest_dir, "/",
+            plan.file_creation_year, NULL)) {
+        return false;
+    }
+    mkdir(target_path, 0755);
+    if (!pstr_vcat(target_path, sizeof(target_path), "/", plan.file_creation_month, NULL)) {
+        return false;
+    }
+    mkdir(target_path, 0755);
+    return pstr_vcat(target_path, sizeof(target_path), "/", plan.file_new_name, NULL) &&
+        write_corpus_file(file, target_path);
+}
+
+
+/*!
+  Makes the whole corpus in `src_dir`, with its collisions in `dest_dir`, and counts
+  what we made in `corpus`. Returns false if we couldn't write something.
+  */
+static bool
+make_corpus(struct corpus *corpus, char const *src_dir, char const *dest_dir)
+{
+    struct corpus_options const options = corpus->options;
+    *corpus = (struct corpus){.options = options};
+    assert(parse_hash_kind(options.hash_name, &corpus->hash_kind));
+    mkdir(src_dir, 0755);
+    mkdir(dest_dir, 0755);
+
+    // Videos have a few hundred bytes of headers before their data
+    size_t const max_jpeg_size = KB_TO_B((size_t)options.max_jpeg_kb);
+    size_t const max_video_size = CORPUS_VIDEO_DATA_SIZE + KB_TO_B(1);
+    corpus->buffer = (uint8_t*)malloc(max_jpeg_size > max_video_size ?
+        max_jpeg_size : max_video_size);
+    if (!corpus->buffer) {
+        printf("error | Not enough memory to make the corpus.\n");
+        return false;
+    }
+
+    bool did_succeed = true;
+    for (size_t idx = 0; idx < (size_t)options.n_files; idx++) {
+        struct corpus_file file;
+        make_corpus_file(corpus, idx, &file);
+
+        char path[MAX_PATH] = {};
+        assert(pstr_vcat(path, sizeof(path), src_dir, "/", file.name, NULL));
+        if (!write_corpus_file(&file, path)) {
+            printf("error | Could not write %s\n", path);
+            did_succeed = false;
+            break;
+        }
+        corpus->n_files_of_kind[file.kind]++;
+        corpus->n_bytes += file.data_size;
+
+        uint64_t state = XXH64(&idx, sizeof(idx), ~(uint64_t)options.seed);
+        if ((int)(get_next_random(&state) % 100) < options.collision_percent) {
+            if (!make_collision(corpus, &file, path, dest_dir)) {
+                printf("error | Could not put a copy of %s in %s\n", path, dest_dir);
+                did_succeed = false;
+                break;
+            }
+            corpus->n_collisions++;
+            corpus->n_bytes += file.data_size;
+        }
+    }
+
+    free(corpus->plan_buffer);
+    free(corpus->buffer);
+    corpus->plan_buffer = NULL;
+    corpus->buffer = NULL;
+    return did_succeed;
+}
+
+
+static void
+print_corpus(struct corpus const *corpus, double const time_taken)
+{
+    printf("corpus: %d files (", corpus->options.n_files);
+    for (size_t idx = 0; idx < N_CORPUS_FILE_KINDS; idx++) {
+        printf("%s%zu %s", idx > 0 ? ", " : "", corpus->n_files_of_kind[idx],
+            CORPUS_FILE_KIND_NAMES[idx]);
+    }
+    printf("), %zu collisions, %.1f MB written in %.1fs\n",
+        corpus->n_collisions, (double)corpus->n_bytes / MB_TO_B(1), time_taken);
+}
+
+
+#if !defined(BENCH_CORPUS_NO_MAIN)
+static double
+get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+int
+main(int argc, char const **argv)
+{
+    static char const * const usage[] = {"bench_corpus [options] SRC_DIR DEST_DIR", NULL};
+    struct corpus corpus = {.options = get_default_corpus_options()};
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        CORPUS_OPTIONS(&corpus.options),
+        OPT_END(),
+    };
+    struct argparse argparse;
+    argparse_init(&argparse, options, usage, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+    if (argc != 2 || !are_corpus_options_valid(&corpus.options)) {
+        argparse_usage(&argparse);
+        return 1;
+    }
+
+    double const start_time = get_time();
+    if (!make_corpus(&corpus, argv[0], argv[1])) {
+        return 1;
+    }
+    print_corpus(&corpus, get_time() - start_time);
+
+    return EXIT_SUCCESS;
+}
+#endif
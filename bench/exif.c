@@ -0,0 +1,128 @@
+// © 2021 Vlad-Stefan Harbuz <vlad@vladh.net>
+// SPDX-License-Identifier: blessing
+
+// Compares how many files per second we can get creation dates out of with our own
+// parser, with libexif reading from the same buffer, and with libexif reading the
+// whole file itself, which is what we used to do.
+//
+// Usage: bench_exif FILE...
+//
+// Files are read once before they're timed, so this measures parsing, not I/O, except
+// for libexif reading the file itself, which can't avoid it.
+
+#define FOTOGRAFISKA_NO_MAIN
+#include "../fotografiska.c"
+
+
+static size_t const N_ROUNDS = 50;
+
+
+enum parser {
+    PARSER_BUILTIN,
+    PARSER_LIBEXIF,
+    PARSER_LIBEXIF_FROM_FILE,
+};
+
+
+static double
+get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+/*!
+  What `exif_data_new_from_file()` used to do for every file.
+  */
+static bool
+get_libexif_date_from_file(char const *path, char *date, size_t const date_size)
+{
+    ExifData *exif_data = exif_data_new_from_file(path);
+    if (!exif_data) {
+        return false;
+    }
+    char value[20] = {};
+    bool const could_get_date =
+        get_exif_tag(exif_data, EXIF_IFD_0, EXIF_TAG_DATE_TIME, value, sizeof(value)) &&
+        use_exif_date(value, sizeof(value), date);
+    exif_data_unref(exif_data);
+    return could_get_date;
+}
+
+
+/*!
+  Gets the date of every file in `paths` `N_ROUNDS` times and prints how quickly
+  that went.
+  */
+static void
+run_bench(char const **paths, size_t const n_paths, enum parser const parser)
+{
+    char *buffer = NULL;
+    size_t n_files = 0;
+    size_t n_dates = 0;
+    double total_time = 0;
+
+    for (size_t idx = 0; idx < n_paths; idx++) {
+        struct stat st;
+        if (stat(paths[idx], &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        struct file_view view;
+        if (
+            !open_file_view(paths[idx], st.st_size, HASH_XXH64, true, &buffer, &view)
+        ) {
+            printf("error | Could not read %s\n", paths[idx]);
+            continue;
+        }
+
+        double const start_time = get_time();
+        for (size_t idx_round = 0; idx_round < N_ROUNDS; idx_round++) {
+            char date[20] = {};
+            bool could_get_date = false;
+            if (parser == PARSER_BUILTIN) {
+                could_get_date = get_builtin_date(&view, date, sizeof(date));
+            } else if (parser == PARSER_LIBEXIF) {
+                could_get_date = get_libexif_date(&view, date, sizeof(date));
+            } else {
+                could_get_date = get_libexif_date_from_file(paths[idx], date, sizeof(date));
+            }
+            if (idx_round == 0 && could_get_date) {
+                n_dates++;
+            }
+        }
+        total_time += get_time() - start_time;
+
+        n_files++;
+        close_file_view(&view);
+    }
+
+    free(buffer);
+
+    char const *parser_names[] = {"builtin", "libexif", "libexif (from file)"};
+    printf("%-20s %zu files, %zu with dates, %12.1f files/s\n",
+        parser_names[parser],
+        n_files,
+        n_dates,
+        total_time > 0 ? (double)(n_files * N_ROUNDS) / total_time : 0);
+}
+
+
+int
+main(int argc, char const **argv)
+{
+    if (argc < 2) {
+        printf("Usage: bench_exif FILE...\n");
+        return 1;
+    }
+
+    char const **paths = argv + 1;
+    size_t const n_paths = argc - 1;
+
+    run_bench(paths, n_paths, PARSER_BUILTIN);
+    run_bench(paths, n_paths, PARSER_LIBEXIF);
+    run_bench(paths, n_paths, PARSER_LIBEXIF_FROM_FILE);
+
+    return EXIT_SUCCESS;
+}
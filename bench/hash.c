@@ -0,0 +1,165 @@
+// © 2021 Vlad-Stefan Harbuz <vlad@vladh.net>
+// SPDX-License-Identifier: blessing
+
+// Compares how quickly we can hash files when we map them into memory versus when we
+// read them into a buffer, with both a cold and a warm page cache, and then how quickly
+// each `--hash` option goes with a warm page cache.
+//
+// Usage: bench_hash FILE...
+//
+// The cold cache runs ask the kernel to drop each file from the page cache before
+// reading it, which only works for files that don't have unwritten changes.
+
+#define FOTOGRAFISKA_NO_MAIN
+#include "../fotografiska.c"
+
+
+static double
+get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+/*!
+  Asks the kernel to forget the cached pages for the file at `path`.
+  */
+static void
+evict_from_page_cache(char const *path)
+{
+    int const fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+
+/*!
+  Hashes every file in `paths` and prints the throughput.
+  */
+static void
+run_bench(char const **paths, size_t const n_paths, bool const can_mmap, bool const is_cold)
+{
+    char *buffer = NULL;
+    uint64_t n_bytes = 0;
+    size_t n_files = 0;
+    double total_time = 0;
+    XXH64_hash_t checksum = 0;
+
+    for (size_t idx = 0; idx < n_paths; idx++) {
+        struct stat st;
+        if (stat(paths[idx], &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (is_cold) {
+            evict_from_page_cache(paths[idx]);
+        }
+
+        double const start_time = get_time();
+        struct file_view view;
+        if (
+            !open_file_view(paths[idx], st.st_size, HASH_XXH64, can_mmap, &buffer, &view)
+        ) {
+            printf("error | Could not read %s\n", paths[idx]);
+            continue;
+        }
+        checksum ^= XXH64(view.data, view.size, 0);
+        n_bytes += view.size;
+        n_files++;
+        close_file_view(&view);
+        total_time += get_time() - start_time;
+    }
+
+    free(buffer);
+
+    printf("%s %s: %zu files, %8.1f MB/s, %10.1f files/s (checksum %016llx)\n",
+        can_mmap ? "mmap" : "read",
+        is_cold ? "cold" : "warm",
+        n_files,
+        total_time > 0 ? (double)n_bytes / MB_TO_B(1) / total_time : 0,
+        total_time > 0 ? (double)n_files / total_time : 0,
+        (long long unsigned)checksum);
+}
+
+
+/*!
+  Hashes every file in `paths` with `kind`, the way fotografiska would, and prints how
+  many files per second that took. The files should already be in the page cache.
+  */
+static void
+run_hash_kind_bench(char const **paths, size_t const n_paths, enum hash_kind const kind)
+{
+    char *buffer = NULL;
+    uint64_t n_bytes = 0;
+    size_t n_files = 0;
+    double total_time = 0;
+    XXH128_hash_t checksum = {};
+
+    for (size_t idx = 0; idx < n_paths; idx++) {
+        struct stat st;
+        if (stat(paths[idx], &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        double const start_time = get_time();
+        struct file_view view;
+        XXH128_hash_t hash;
+        bool const could_hash =
+            open_file_view(paths[idx], st.st_size, kind, true, &buffer, &view) &&
+            get_file_hash(&view, kind, &hash);
+        close_file_view(&view);
+        total_time += get_time() - start_time;
+        if (!could_hash) {
+            printf("error | Could not read %s\n", paths[idx]);
+            continue;
+        }
+
+        checksum.low64 ^= hash.low64;
+        checksum.high64 ^= hash.high64;
+        n_bytes += st.st_size;
+        n_files++;
+    }
+
+    free(buffer);
+
+    printf("%-8s: %zu files, %8.1f MB/s of files, %10.1f files/s (checksum %016llx%016llx)\n",
+        HASH_KIND_NAMES[kind],
+        n_files,
+        total_time > 0 ? (double)n_bytes / MB_TO_B(1) / total_time : 0,
+        total_time > 0 ? (double)n_files / total_time : 0,
+        (long long unsigned)checksum.high64,
+        (long long unsigned)checksum.low64);
+}
+
+
+int
+main(int argc, char const **argv)
+{
+    if (argc < 2) {
+        printf("Usage: bench_hash FILE...\n");
+        return 1;
+    }
+
+    char const **paths = argv + 1;
+    size_t const n_paths = argc - 1;
+
+    run_bench(paths, n_paths, true, true);
+    run_bench(paths, n_paths, false, true);
+
+    // Make sure everything is in the page cache before the warm runs
+    run_bench(paths, n_paths, true, false);
+    run_bench(paths, n_paths, true, false);
+    run_bench(paths, n_paths, false, false);
+
+    run_hash_kind_bench(paths, n_paths, HASH_XXH64);
+    run_hash_kind_bench(paths, n_paths, HASH_XXH3_64);
+    run_hash_kind_bench(paths, n_paths, HASH_XXH3_128);
+    run_hash_kind_bench(paths, n_paths, HASH_SAMPLED);
+    run_hash_kind_bench(paths, n_paths, HASH_FULL);
+
+    return EXIT_SUCCESS;
+}
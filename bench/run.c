@@ -0,0 +1,436 @@
+// © 2021 Vlad-Stefan Harbuz <vlad@vladh.net>
+// SPDX-License-Identifier: blessing
+
+// Makes a synthetic corpus (see corpus.c) and times fotografiska on it:
+//
+// * a dry run with a cold page cache, then again with a warm one
+// * finding dates, hashing and moving files on their own, in this process, with a warm
+//   page cache
+// * a real run with a cold page cache, then with a warm one, on a fresh corpus each time
+//
+// For each fotografiska run, we print how many files per second it got through, how
+// much CPU time it took, and how much memory it used at most, followed by its own
+// `--stats text`.
+//
+// Usage: bench_run [options]
+//
+// The cold runs ask the kernel to drop each file in the corpus from the page cache
+// first, after writing everything out to the disk, so they don't need root. They can't
+// drop the folders themselves though, so listing them is always warm.
+
+#define BENCH_CORPUS_NO_MAIN
+#include "corpus.c"
+
+#include <ftw.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+
+static size_t const MAX_FOTOGRAFISKA_ARGS = 64;
+
+
+struct bench {
+    struct corpus corpus;
+    char const *fotografiska_path;
+    char *extra_args;
+    char hash_name[16];
+    char const *dir;
+    char src_dir[MAX_PATH];
+    char dest_dir[MAX_PATH];
+};
+
+
+static double
+get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+static double
+timeval_to_s(struct timeval const *tv)
+{
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+
+static int
+remove_path(char const *path, struct stat const *st, int const type, struct FTW *ftw)
+{
+    remove(path);
+    return 0;
+}
+
+
+static void
+remove_tree(char const *path)
+{
+    nftw(path, remove_path, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+
+static int
+evict_path(char const *path, struct stat const *st, int const type, struct FTW *ftw)
+{
+    if (type == FTW_F) {
+        int const fd = open(path, O_RDONLY);
+        if (fd != -1) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+
+/*!
+  Writes everything out to the disk, then asks the kernel to forget the cached pages
+  for every file in the corpus.
+  */
+static void
+evict_corpus(struct bench const *bench)
+{
+    sync();
+    nftw(bench->src_dir, evict_path, 64, FTW_PHYS);
+    nftw(bench->dest_dir, evict_path, 64, FTW_PHYS);
+}
+
+
+/*!
+  Throws away whatever was in the bench dir, and makes a fresh corpus.
+  */
+static bool
+remake_corpus(struct bench *bench)
+{
+    remove_tree(bench->src_dir);
+    remove_tree(bench->dest_dir);
+    double const start_time = get_time();
+    if (!make_corpus(&bench->corpus, bench->src_dir, bench->dest_dir)) {
+        return false;
+    }
+    print_corpus(&bench->corpus, get_time() - start_time);
+    return true;
+}
+
+
+/*!
+  Prints the stats fotografiska printed to `log_path`.
+  */
+static void
+print_fotografiska_stats(char const *log_path)
+{
+    FILE *log = fopen(log_path, "r");
+    if (!log) {
+        return;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), log)) {
+        if (strncmp(line, "Stats: ", 7) == 0) {
+            printf("    %s", line + 7);
+        }
+    }
+    fclose(log);
+}
+
+
+/*!
+  If we're passing `--hash` to fotografiska, makes the corpus with the same hash, so that
+  the copies in the destination folder get the names fotografiska will look for.
+  */
+static void
+use_hash_from_extra_args(struct bench *bench)
+{
+    char extra_args[1024] = {};
+    if (!bench->extra_args || !pstr_copy(extra_args, sizeof(extra_args), bench->extra_args)) {
+        return;
+    }
+    char *save_ptr = NULL;
+    for (
+        char *arg = strtok_r(extra_args, " ", &save_ptr);
+        arg;
+        arg = strtok_r(NULL, " ", &save_ptr)
+    ) {
+        char const *hash_name = NULL;
+        if (pstr_eq(arg, "--hash")) {
+            hash_name = strtok_r(NULL, " ", &save_ptr);
+        } else if (pstr_starts_with(arg, "--hash=")) {
+            hash_name = arg + strlen("--hash=");
+        }
+        if (hash_name && pstr_copy(bench->hash_name, sizeof(bench->hash_name), hash_name)) {
+            bench->corpus.options.hash_name = bench->hash_name;
+        }
+    }
+}
+
+
+/*!
+  Runs fotografiska on the corpus, with its output going to `log_name`.log in the
+  bench dir, and prints how it went.
+  */
+static bool
+run_fotografiska(
+    struct bench const *bench, char const *name, char const *log_name, bool const is_dry_run
+) {
+    char log_path[MAX_PATH] = {};
+    if (!pstr_vcat(log_path, sizeof(log_path), bench->dir, "/", log_name, ".log", NULL)) {
+        printf("error | The bench dir's path is too long.\n");
+        return false;
+    }
+
+    char extra_args[1024] = {};
+    char const *args[MAX_FOTOGRAFISKA_ARGS];
+    size_t n_args = 0;
+    args[n_args++] = bench->fotografiska_path;
+    args[n_args++] = "--src-dir";
+    args[n_args++] = bench->src_dir;
+    args[n_args++] = "--dest-dir";
+    args[n_args++] = bench->dest_dir;
+    args[n_args++] = "--quiet";
+    args[n_args++] = "--stats";
+    args[n_args++] = "text";
+    if (is_dry_run) {
+        args[n_args++] = "--dry-run";
+    }
+    if (bench->extra_args && pstr_copy(extra_args, sizeof(extra_args), bench->extra_args)) {
+        char *save_ptr = NULL;
+        for (
+            char *arg = strtok_r(extra_args, " ", &save_ptr);
+            arg && n_args < MAX_FOTOGRAFISKA_ARGS - 1;
+            arg = strtok_r(NULL, " ", &save_ptr)
+        ) {
+            args[n_args++] = arg;
+        }
+    }
+    args[n_args] = NULL;
+
+    fflush(stdout);
+    double const start_time = get_time();
+    pid_t const pid = fork();
+    if (pid == -1) {
+        printf("error | Could not start %s\n", bench->fotografiska_path);
+        return false;
+    }
+    if (pid == 0) {
+        int const log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log_fd != -1) {
+            dup2(log_fd, STDOUT_FILENO);
+            close(log_fd);
+        }
+        execv(bench->fotografiska_path, (char * const *)args);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage = {};
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        printf("error | Could not wait for %s\n", bench->fotografiska_path);
+        return false;
+    }
+    double const time_taken = get_time() - start_time;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("error | %s failed, see %s\n", name, log_path);
+        return false;
+    }
+
+    int const n_files = bench->corpus.options.n_files;
+    printf("%-16s %d files in %.3fs, %10.1f files/s, %.3fs CPU, peak RSS %.1f MB\n",
+        name, n_files, time_taken,
+        time_taken > 0 ? (double)n_files / time_taken : 0,
+        timeval_to_s(&usage.ru_utime) + timeval_to_s(&usage.ru_stime),
+        (double)usage.ru_maxrss / KB_TO_B(1));
+    print_fotografiska_stats(log_path);
+    return true;
+}
+
+
+/*!
+  Finds dates in and hashes every file in the corpus, timing each separately, the
+  way fotografiska would for a file that isn't in its cache. The page cache should
+  already be warm.
+  */
+static void
+run_read_stages_bench(struct bench const *bench)
+{
+    char *buffer = NULL;
+    size_t n_files = 0;
+    size_t n_dates = 0;
+    uint64_t n_bytes = 0;
+    double date_time = 0;
+    double hash_time = 0;
+    XXH64_hash_t checksum = 0;
+
+    tinydir_dir dir;
+    if (tinydir_open(&dir, bench->src_dir) == -1) {
+        printf("error | Could not open %s\n", bench->src_dir);
+        return;
+    }
+    for (; dir.has_next; tinydir_next(&dir)) {
+        tinydir_file file;
+        if (tinydir_readfile(&dir, &file) != 0 || file.is_dir) {
+            continue;
+        }
+        size_t const file_size = file._s.st_size;
+        struct file_view view;
+        if (
+            !open_file_view(file.path, file_size, bench->corpus.hash_kind, true, &buffer,
+                &view)
+        ) {
+            printf("error | Could not read %s\n", file.path);
+            continue;
+        }
+
+        double const date_start_time = get_time();
+        char date[20] = {};
+        if (get_embedded_date(&view, date, sizeof(date))) {
+            n_dates++;
+        }
+        double const hash_start_time = get_time();
+        XXH128_hash_t hash;
+        get_file_hash(&view, bench->corpus.hash_kind, &hash);
+        double const end_time = get_time();
+
+        date_time += hash_start_time - date_start_time;
+        hash_time += end_time - hash_start_time;
+        checksum ^= hash.low64 ^ hash.high64;
+        n_bytes += view.size;
+        n_files++;
+        close_file_view(&view);
+    }
+    tinydir_close(&dir);
+    free(buffer);
+
+    printf("%-16s %zu files, %zu with dates, %10.1f files/s\n",
+        "date stage", n_files, n_dates, date_time > 0 ? (double)n_files / date_time : 0);
+    printf("%-16s %zu files, %8.1f MB/s, %10.1f files/s (checksum %016llx)\n",
+        "hash stage", n_files,
+        hash_time > 0 ? (double)n_bytes / MB_TO_B(1) / hash_time : 0,
+        hash_time > 0 ? (double)n_files / hash_time : 0,
+        (long long unsigned)checksum);
+}
+
+
+/*!
+  Moves every file in the corpus into a new folder in the bench dir, the way
+  fotografiska would, and times only the moves. We make the year and month folders
+  before we start, so that we don't print anything while we're timing.
+  */
+static void
+run_move_stage_bench(struct bench const *bench)
+{
+    char *buffer = NULL;
+    size_t n_files = 0;
+    double move_time = 0;
+
+    char moved_dir[MAX_PATH] = {};
+    assert(pstr_vcat(moved_dir, sizeof(moved_dir), bench->dir, "/moved", NULL));
+    remove_tree(moved_dir);
+    mkdir(moved_dir, 0755);
+    struct target_dir target;
+    if (!open_target_dir(&target, moved_dir)) {
+        printf("error | Could not open %s\n", moved_dir);
+        return;
+    }
+    struct run const run = {.hash_kind = bench->corpus.hash_kind};
+
+    tinydir_dir dir;
+    if (tinydir_open(&dir, bench->src_dir) == -1) {
+        printf("error | Could not open %s\n", bench->src_dir);
+        close_target_dir(&target);
+        return;
+    }
+    // We're moving files out of the folder while we go through it, which is fine,
+    // since readdir() still gives us every file that's left exactly once
+    for (; dir.has_next; tinydir_next(&dir)) {
+        tinydir_file file;
+        if (tinydir_readfile(&dir, &file) != 0 || file.is_dir) {
+            continue;
+        }
+        struct file_plan plan = {};
+        if (!plan_file_move(&run, &file, &buffer, &plan)) {
+            continue;
+        }
+        char month_directory[8] = {};
+        assert(pstr_vcat(month_directory, sizeof(month_directory),
+            plan.file_creation_year, "/", plan.file_creation_month, NULL));
+        mkdirat(target.fd, plan.file_creation_year, 0755);
+        mkdirat(target.fd, month_directory, 0755);
+
+        double const start_time = get_time();
+        enum move_result const result = move_file_to_dest_dir(file.path, &target,
+            plan.file_new_name, plan.file_creation_year, plan.file_creation_month);
+        move_time += get_time() - start_time;
+        if (result == MOVE_DONE) {
+            n_files++;
+        }
+    }
+    tinydir_close(&dir);
+    close_target_dir(&target);
+    free(buffer);
+    remove_tree(moved_dir);
+
+    printf("%-16s %zu files, %10.1f files/s\n",
+        "move stage", n_files, move_time > 0 ? (double)n_files / move_time : 0);
+}
+
+
+int
+main(int argc, char const **argv)
+{
+    static char const * const usage[] = {"bench_run [options]", NULL};
+    struct bench bench = {
+        .corpus = {.options = get_default_corpus_options()},
+        .fotografiska_path = "bin/fotografiska",
+        .dir = "/tmp/fotografiska_bench",
+    };
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        CORPUS_OPTIONS(&bench.corpus.options),
+        OPT_STRING(0, "dir", &bench.dir, "where to make the corpus, which is deleted and made again (default /tmp/fotografiska_bench)"),
+        OPT_STRING(0, "fotografiska", &bench.fotografiska_path, "the fotografiska to run (default bin/fotografiska)"),
+        OPT_STRING(0, "args", &bench.extra_args, "more arguments to pass to fotografiska, separated by spaces, for example \"--jobs 4\""),
+        OPT_END(),
+    };
+    struct argparse argparse;
+    argparse_init(&argparse, options, usage, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+    use_hash_from_extra_args(&bench);
+    if (argc != 0 || !are_corpus_options_valid(&bench.corpus.options)) {
+        argparse_usage(&argparse);
+        return 1;
+    }
+
+    mkdir(bench.dir, 0755);
+    if (
+        !pstr_vcat(bench.src_dir, sizeof(bench.src_dir), bench.dir, "/src", NULL) ||
+        !pstr_vcat(bench.dest_dir, sizeof(bench.dest_dir), bench.dir, "/dest", NULL)
+    ) {
+        printf("error | The bench dir's path is too long.\n");
+        return 1;
+    }
+
+    bool did_succeed = remake_corpus(&bench);
+
+    evict_corpus(&bench);
+    did_succeed = did_succeed && run_fotografiska(&bench, "dry run, cold", "dry_run_cold", true);
+    did_succeed = did_succeed && run_fotografiska(&bench, "dry run, warm", "dry_run_warm", true);
+
+    if (did_succeed) {
+        run_read_stages_bench(&bench);
+        run_move_stage_bench(&bench);
+    }
+
+    did_succeed = did_succeed && remake_corpus(&bench);
+    if (did_succeed) {
+        evict_corpus(&bench);
+    }
+    did_succeed = did_succeed && run_fotografiska(&bench, "real run, cold", "real_run_cold", false);
+
+    // We've just written the corpus, so it's all in the page cache
+    did_succeed = did_succeed && remake_corpus(&bench);
+    did_succeed = did_succeed && run_fotografiska(&bench, "real run, warm", "real_run_warm", false);
+
+    return did_succeed ? EXIT_SUCCESS : 1;
+}
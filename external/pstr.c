@@ -315,3 +315,38 @@ bool pstr_from_int64(
 
   return true;
 }
+
+
+bool pstr_from_uint64_hex(
+  char *str, size_t const str_size, uint64_t number, size_t const min_len,
+  size_t *new_str_len
+) {
+  static char const digits[] = "0123456789abcdef";
+  *new_str_len = 0;
+
+  // Count the digits up front, so that we can fill the string in from the end
+  size_t len = 1;
+  while (len < 16 && (number >> (len * 4)) != 0) {
+    len++;
+  }
+  if (len < min_len) {
+    len = min_len;
+  }
+
+  // Check that we have space for the digits and the NULL terminator
+  if (len + 1 > str_size) {
+    if (str_size > 0) {
+      str[0] = 0;
+    }
+    return false;
+  }
+
+  str[len] = '\0';
+  for (size_t idx = len; idx > 0; idx--) {
+    str[idx - 1] = digits[number & 0xf];
+    number >>= 4;
+  }
+
+  *new_str_len = len;
+  return true;
+}
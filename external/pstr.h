@@ -178,3 +178,15 @@ void pstr_trim_char(char *str, char const target);
 bool pstr_from_int64(
   char *str, size_t const str_size, int64_t number, size_t *new_str_len
 );
+
+/*!
+  Puts a lowercase hexadecimal representation of `number` into `str`, padded with
+  leading zeros to at least `min_len` digits.
+  Returns true if it succeeds. If the number does not fit into `str` because its
+  length is more than `str_size` characters, this function fails and returns false,
+  with `str` being set to an empty string.
+*/
+bool pstr_from_uint64_hex(
+  char *str, size_t const str_size, uint64_t number, size_t const min_len,
+  size_t *new_str_len
+);
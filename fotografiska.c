@@ -1,15 +1,36 @@
 // © 2021 Vlad-Stefan Harbuz <vlad@vladh.net>
 // SPDX-License-Identifier: blessing
 
+// We need POSIX threads and memory mapping, which aren't part of C99 proper.
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
 
+#if defined(USE_LIBEXIF)
 #include <libexif/exif-data.h>
+#endif
 #include "external/tinydir.h"
 #include "external/xxhash.h"
 #include "external/argparse.h"
@@ -35,6 +56,20 @@
 #endif
 #endif
 
+#if !defined(O_BINARY)
+#define O_BINARY 0
+#endif
+
+#if defined(_WIN32)
+#define fsync _commit
+#endif
+
+// io_uring learned to rename files in Linux 5.11, which is also when
+// IORING_FEAT_EXT_ARG was added, so that tells us whether our headers are new enough.
+#if defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup) && defined(RENAME_NOREPLACE)
+#define CAN_USE_IO_URING
+#endif
+
 #define KB_TO_B(Value) ((Value) * 1024LL)
 #define MB_TO_B(Value) (KB_TO_B(Value) * 1024LL)
 #define GB_TO_B(Value) (MB_TO_B(Value) * 1024LL)
@@ -42,6 +77,28 @@
 
 
 static uint32_t const MAX_HASHABLE_SIZE = MB_TO_B(10);
+// How much of the start and end of a file we hash with `--hash sampled`
+static uint32_t const HASH_SAMPLE_SIZE = KB_TO_B(128);
+#if defined(CAN_USE_IO_URING)
+// How many files the io_uring engine keeps in flight, and how many bytes it can have
+// read into memory at once, since it can't map files like the usual way does.
+static uint32_t const URING_N_SLOTS = 64;
+static size_t const URING_MAX_BYTES_IN_FLIGHT = MB_TO_B(256);
+#endif
+#if defined(USE_LIBEXIF)
+// An EXIF APP1 segment can't be bigger than 64KB, but it doesn't have to be the first
+// segment in a JPEG, so leave some room for whatever comes before it.
+static uint32_t const MAX_EXIF_SIZE = KB_TO_B(256);
+#endif
+static char const * const CACHE_FILE_NAME = ".fotografiska.cache";
+static char const CACHE_MAGIC[8] = {'F', 'T', 'G', 'C', 'A', 'C', 'H', 'E'};
+static uint32_t const CACHE_VERSION = 4;
+static char const * const JOURNAL_FILE_NAME = ".fotografiska.journal";
+static char const JOURNAL_MAGIC[8] = {'F', 'T', 'G', 'J', 'R', 'N', 'A', 'L'};
+static uint32_t const JOURNAL_VERSION = 1;
+// How many records we add to the journal between `fsync()`s. If we're interrupted,
+// this is how many moves we might have to check again.
+static uint32_t const JOURNAL_N_RECORDS_PER_SYNC = 1024;
 static char const * const USAGE_PARTS[] = {"fotografiska [options]", NULL};
 static char const * const USAGE_BODY = "";
 static char const * const USAGE_EPILOGUE = ""
@@ -50,7 +107,9 @@ static char const * const USAGE_EPILOGUE = ""
 "fotografiska organises your photos/videos into a certain directory structure that is easy\n"
 "to browse with a regular file manager.\n"
 "\n"
-"Your photos/videos should be in a single folder (files in nested folders won't be used).\n"
+"Your photos/videos should be in a single folder (files in nested folders won't be used,\n"
+"unless you pass --recursive). You can read from more than one folder at once by passing\n"
+"--src-dir more than once.\n"
 "They will be organised into subfolders by year and month, and their filename will start\n"
 "with the date they were taken, as well as including a unique hash of (part of) the file.\n"
 "\n"
@@ -103,6 +162,7 @@ format_exif_date(char *date)
 }
 
 
+#if defined(USE_LIBEXIF)
 /*!
   Returns the value of an EXIF `tag` in the buffer `buf`.
   */
@@ -118,6 +178,7 @@ get_exif_tag(
     }
     return false;
 }
+#endif
 
 
 /*!
@@ -134,241 +195,4813 @@ split_creation_date(
 
 
 /*!
-  Moves the actual file to the proper place once we've found its new name.
+  A folder we move files into. We keep it open, so that we can create folders and
+  move files relative to it without the kernel walking the whole path every time.
+  We also remember the year and month folders we know exist in it, so that we only
+  check for or create each of them once, rather than for every file.
+
+  There are only ever a few hundred year and month folders, so we just go through
+  them one by one, starting with the last one we used, since files from the same
+  month tend to come one after another.
+
+  Windows won't let us open folders, so there we use `path` for everything instead,
+  and `fd` is always -1.
   */
+struct target_dir {
+    char const *path;
+    int fd;
+    char (*known_subdirs)[8]; // YYYY0 or YYYY/mm0
+    size_t n_known_subdirs;
+    size_t known_subdirs_cap;
+    size_t idx_last_used;
+};
+
+
 static bool
-move_file_to_dest_dir(
-    char const *source_path, char const *dest_dir, char const *file_new_name,
-    char const *file_creation_year, char const *file_creation_month
-) {
-    struct stat st = {};
+open_target_dir(struct target_dir *dir, char const *path)
+{
+    *dir = (struct target_dir){.path = path, .fd = -1};
+#if defined(_WIN32)
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#else
+    dir->fd = open(path, O_RDONLY | O_DIRECTORY);
+    return dir->fd != -1;
+#endif
+}
 
-    // Make sure the first part of the target directory exists (the year)
-    char year_directory[MAX_PATH] = {};
-    if (!pstr_vcat(year_directory, MAX_PATH, dest_dir, "/", file_creation_year, NULL)) {
-        printf("error | Your file paths are too long, so we couldn't move this file.\n");
-        return false;
+
+/*!
+  Gets the stat info of `path`, which is relative to `dir`, into `st`.
+  */
+static bool
+stat_in_target_dir(struct target_dir const *dir, char const *path, struct stat *st)
+{
+#if defined(_WIN32)
+    char full_path[MAX_PATH] = {};
+    return pstr_vcat(full_path, MAX_PATH, dir->path, "/", path, NULL) &&
+        stat(full_path, st) == 0;
+#else
+    return fstatat(dir->fd, path, st, 0) == 0;
+#endif
+}
+
+
+static void
+close_target_dir(struct target_dir *dir)
+{
+    if (dir->fd != -1) {
+        close(dir->fd);
     }
-    if (stat(year_directory, &st) == -1) {
-        printf("Creating directory: %s\n", year_directory);
-        if (mkdir(year_directory, 0700) == -1) {
-            printf("ERROR: Could not create directory! Please check you have permissions.\n");
-            return false;
+    free(dir->known_subdirs);
+    *dir = (struct target_dir){.fd = -1};
+}
+
+
+static bool
+is_known_subdir(struct target_dir *dir, char const *subdir)
+{
+    if (
+        dir->idx_last_used < dir->n_known_subdirs &&
+        pstr_eq(dir->known_subdirs[dir->idx_last_used], subdir)
+    ) {
+        return true;
+    }
+    for (size_t idx = 0; idx < dir->n_known_subdirs; idx++) {
+        if (pstr_eq(dir->known_subdirs[idx], subdir)) {
+            dir->idx_last_used = idx;
+            return true;
         }
     }
+    return false;
+}
 
-    // Make sure the month subdirectory exists
-    char month_directory[MAX_PATH] = {};
-    if (!pstr_vcat(month_directory, MAX_PATH, year_directory, "/", file_creation_month, NULL)) {
+
+/*!
+  Makes sure the folder `subdir` exists in `dir`, creating it if it doesn't.
+  `subdir` has to fit in 8 bytes, which is enough for YYYY/mm.
+  */
+static bool
+ensure_subdir(struct target_dir *dir, char const *subdir)
+{
+    if (is_known_subdir(dir, subdir)) {
+        return true;
+    }
+
+#if defined(_WIN32)
+    char path[MAX_PATH] = {};
+    if (!pstr_vcat(path, MAX_PATH, dir->path, "/", subdir, NULL)) {
         printf("error | Your file paths are too long, so we couldn't move this file.\n");
         return false;
     }
-    if (stat(month_directory, &st) == -1) {
-        printf("Creating directory: %s\n", month_directory);
-        if (mkdir(month_directory, 0700) == -1) {
-            printf("error | Could not create directory! Please check you have permissions.\n");
-            return false;
+    bool const did_create = mkdir(path, 0700) == 0;
+#else
+    bool const did_create = mkdirat(dir->fd, subdir, 0700) == 0;
+#endif
+    if (did_create) {
+        printf("Creating directory: %s/%s\n", dir->path, subdir);
+    } else if (errno != EEXIST) {
+        printf("error | Could not create directory! Please check you have permissions.\n");
+        return false;
+    }
+
+    if (dir->n_known_subdirs == dir->known_subdirs_cap) {
+        size_t const new_cap = dir->known_subdirs_cap ? dir->known_subdirs_cap * 2 : 64;
+        char (*new_known_subdirs)[8] = (char(*)[8])realloc(dir->known_subdirs,
+            new_cap * sizeof(*dir->known_subdirs));
+        if (!new_known_subdirs) {
+            // We'll just have to check again next time
+            return true;
         }
+        dir->known_subdirs = new_known_subdirs;
+        dir->known_subdirs_cap = new_cap;
+    }
+    if (pstr_copy(dir->known_subdirs[dir->n_known_subdirs], 8, subdir)) {
+        dir->idx_last_used = dir->n_known_subdirs;
+        dir->n_known_subdirs++;
     }
 
-    // Make the final destination path
-    char target_path[MAX_PATH] = {};
-    if (!pstr_vcat(target_path, MAX_PATH, month_directory, "/", file_new_name, NULL)) {
-        printf("error | Your file paths are too long, so we couldn't move this file.\n");
-        return false;
+    return true;
+}
+
+
+/*!
+  What happened when we tried to put a file in its new home.
+  */
+enum move_result {
+    // We didn't try, because this is a dry run or it's a duplicate we're leaving alone
+    MOVE_NOT_TRIED,
+    MOVE_DONE,
+    MOVE_TARGET_EXISTS,
+    MOVE_FAILED,
+};
+
+
+/*!
+  Prints why we couldn't move a file to `target_path` in `dir`, given the `errno` we got,
+  and returns what that means for the file.
+  */
+static enum move_result
+print_move_error(struct target_dir const *dir, char const *target_path, int const error)
+{
+    if (error == EEXIST) {
+        printf("%s/%s already exists, so we're not going to do anything.\n",
+            dir->path, target_path);
+        return MOVE_TARGET_EXISTS;
+    }
+    printf("error | Could not move the file to its new home! Please check you have permissions.\n");
+    return MOVE_FAILED;
+}
+
+
+/*!
+  Moves the file at `source_path` to `target_path`, which is relative to `dir`, unless
+  there's already a file there.
+  */
+static enum move_result
+move_file_to_target_dir(
+    char const *source_path, struct target_dir const *dir, char const *target_path
+) {
+#if defined(RENAME_NOREPLACE)
+    // This checks that there's no file there and moves ours in one go, so nothing
+    // can sneak in between the check and the move
+    if (renameat2(AT_FDCWD, source_path, dir->fd, target_path, RENAME_NOREPLACE) == 0) {
+        return MOVE_DONE;
+    }
+    // Some filesystems don't support RENAME_NOREPLACE, so do it the old way instead
+    if (errno != EINVAL && errno != ENOSYS) {
+        return print_move_error(dir, target_path, errno);
     }
+#endif
 
     // Check if the file already exists
-    if (stat(target_path, &st) == 0) {
-        printf("%s already exists, so we're not going to do anything.\n", target_path);
-        return false;
+    struct stat st = {};
+    if (stat_in_target_dir(dir, target_path, &st)) {
+        return print_move_error(dir, target_path, EEXIST);
     }
 
     // Move the file!
-    if (rename(source_path, target_path) != 0) {
-        printf("error | Could not move the file to its new home! Please check you have permissions.\n");
-        return false;
+#if defined(_WIN32)
+    char full_target_path[MAX_PATH] = {};
+    if (!pstr_vcat(full_target_path, MAX_PATH, dir->path, "/", target_path, NULL)) {
+        printf("error | Your file paths are too long, so we couldn't move this file.\n");
+        return MOVE_FAILED;
+    }
+    if (rename(source_path, full_target_path) != 0) {
+        return print_move_error(dir, target_path, errno);
+    }
+#else
+    if (renameat(AT_FDCWD, source_path, dir->fd, target_path) != 0) {
+        return print_move_error(dir, target_path, errno);
     }
+#endif
 
-    return true;
+    return MOVE_DONE;
 }
 
 
 /*!
-  Figures out the new filename and location for a file in the destination dir,
-  then puts it there.
+  Moves the actual file to the proper place once we've found its new name.
   */
-static void
-sort_file_into_dest_dir(
-    tinydir_file const *file, char *file_buffer, size_t const file_buffer_size,
-    char const *dest_dir, bool is_dry_run
+static enum move_result
+move_file_to_dest_dir(
+    char const *source_path, struct target_dir *dest_dir, char const *file_new_name,
+    char const *file_creation_year, char const *file_creation_month
 ) {
-    char file_basename[MAX_PATH] = {};
-    char file_new_name[MAX_PATH] = {};
-    char file_creation_date[20] = {}; // YYYY.mm.dd_HH.MM.SS0
-    char file_creation_year[5] = {}; // YYYY0
-    char file_creation_month[3] = {}; // mm0
-    size_t file_size;
-    size_t file_hashable_size;
-    FILE *file_handle;
+    // Make sure the first part of the target directory exists (the year)
+    if (!ensure_subdir(dest_dir, file_creation_year)) {
+        return MOVE_FAILED;
+    }
 
-    // Open file
-    file_handle = fopen(file->path, "r");
-    if (file_handle == NULL) {
-        printf("error | Could not open file %s\n", file->path);
-        goto cleanup_return;
+    // Make sure the month subdirectory exists
+    char month_directory[8] = {};
+    assert(pstr_vcat(month_directory, sizeof(month_directory),
+        file_creation_year, "/", file_creation_month, NULL));
+    if (!ensure_subdir(dest_dir, month_directory)) {
+        return MOVE_FAILED;
     }
 
-    // Get name without extension
-    assert(pstr_copy(file_basename, MAX_PATH, file->name));
-    pstr_slice_to(file_basename, pstr_len(file_basename) - pstr_len(file->extension) - 1);
+    // Make the final destination path
+    char target_path[MAX_PATH] = {};
+    if (!pstr_vcat(target_path, MAX_PATH, month_directory, "/", file_new_name, NULL)) {
+        printf("error | Your file paths are too long, so we couldn't move this file.\n");
+        return MOVE_FAILED;
+    }
 
-    // Get creation date
-    ExifData const *exif_data = exif_data_new_from_file(file->path);
-    bool could_get_exif = false;
+    return move_file_to_target_dir(source_path, dest_dir, target_path);
+}
 
-    if (exif_data) {
-        could_get_exif = get_exif_tag(exif_data, EXIF_IFD_0, EXIF_TAG_DATE_TIME,
-            file_creation_date, sizeof(file_creation_date));
-    }
 
-    // If we could get the EXIF data, great, format it.
-    // If not, get the creation date from the filemtime.
-    if (could_get_exif) {
-        format_exif_date(file_creation_date);
-    } else {
-        // I don't love using `localtime()` and `strftime()`, but here we are.
-        struct tm const *creation_date_tm = localtime(&file->_s.st_mtime);
-        strftime(file_creation_date, sizeof(file_creation_date),
-            "%Y.%m.%d_%H.%M.%S", creation_date_tm);
-    }
+/*!
+  The hashable portion of a file. If we can, this is mapped straight into memory, so
+  that we can hash it without copying it anywhere. If we can't, it's read into a
+  buffer instead. We keep the file open, in case we need to look at anything past
+  the hashable portion, see `get_file_bytes()`.
+  */
+struct file_view {
+    uint8_t const *data;
+    size_t size;
+    void *mapping;
+    size_t mapping_size;
+    int fd;
+    size_t file_size;
+};
 
-    // Set file_creation_year and file_creation_month
-    split_creation_date(file_creation_date, file_creation_year, file_creation_month);
 
-    // Get file size (we will only hash a max of MAX_HASHABLE_SIZE bytes)
-    fseek(file_handle, 0, SEEK_END);
-    file_size = ftell(file_handle);
-    if (file_size >= file_buffer_size) {
-        file_hashable_size = file_buffer_size;
-    } else {
-        file_hashable_size = file_size;
+/*!
+  Unmaps `view` if it was mapped, and closes the file. Buffers are reused, so we
+  leave those alone.
+  */
+static void
+close_file_view(struct file_view *view)
+{
+#if !defined(_WIN32)
+    if (view->mapping) {
+        munmap(view->mapping, view->mapping_size);
     }
-
-    // Read hashable portion into file_buffer
-    fseek(file_handle, 0, SEEK_SET);
-    if (fread(file_buffer, 1, file_hashable_size, file_handle) < file_hashable_size) {
-        printf("error | Could not read entire hashable portion of file %s\n", file->path);
-        goto cleanup_fclose;
+#endif
+    if (view->fd != -1) {
+        close(view->fd);
     }
+    *view = (struct file_view){.fd = -1};
+}
 
-    // Compute the hash
-    XXH64_hash_t const hash = XXH64(file_buffer, file_hashable_size, 0);
-    char hash_string[32] = {};
-    // TODO: Add a function for this to pstr
-    snprintf(hash_string, 32, "%llx", (long long unsigned)hash);
 
+/*!
+  Returns a pointer to `size` bytes at `offset` in the file behind `view`. If they're
+  in the hashable portion we already have, we just point into it. If not, we read
+  them into `scratch`, which is `scratch_size` bytes big. Returns NULL if the bytes
+  aren't in the file, or don't fit in `scratch`.
+  */
+static uint8_t const *
+get_file_bytes(
+    struct file_view const *view, uint64_t const offset, size_t const size,
+    uint8_t *scratch, size_t const scratch_size
+) {
+    if (offset > view->file_size || size > view->file_size - offset) {
+        return NULL;
+    }
+    if (offset + size <= view->size) {
+        return view->data + offset;
+    }
+    if (size > scratch_size || view->fd == -1) {
+        return NULL;
+    }
+#if defined(_WIN32)
     if (
-        !pstr_vcat(file_new_name, MAX_PATH,
-            file_creation_date, "_", hash_string, "_", file_basename, ".", file->extension, NULL)
+        lseek(view->fd, offset, SEEK_SET) != (off_t)offset ||
+        read(view->fd, scratch, size) != (ssize_t)size
     ) {
-        printf("error | Your file paths are too long, so we couldn't move this file.\n");
-        goto cleanup_fclose;
+        return NULL;
+    }
+#else
+    if (pread(view->fd, scratch, size, offset) != (ssize_t)size) {
+        return NULL;
     }
+#endif
+    return scratch;
+}
 
-    char const *dry_run_str = "";
 
-    if (is_dry_run) {
-        dry_run_str = "(dry run) ";
+static uint16_t
+read_u16(uint8_t const *data, bool const is_big_endian)
+{
+    if (is_big_endian) {
+        return (uint16_t)(data[0] << 8 | data[1]);
     }
+    return (uint16_t)(data[1] << 8 | data[0]);
+}
 
-    printf("%s%s -> %s/%s/%s/%s\n",
-        dry_run_str,
-        file->path,
-        dest_dir,
-        file_creation_year,
-        file_creation_month,
-        file_new_name);
-
-    if (!is_dry_run) {
-        bool could_move = move_file_to_dest_dir(
-            file->path, dest_dir, file_new_name, file_creation_year, file_creation_month
-        );
-        if (!could_move) {
-            goto cleanup_fclose;
-        }
+
+static uint32_t
+read_u32(uint8_t const *data, bool const is_big_endian)
+{
+    if (is_big_endian) {
+        return (uint32_t)read_u16(data, true) << 16 | read_u16(data + 2, true);
     }
+    return (uint32_t)read_u16(data + 2, false) << 16 | read_u16(data, false);
+}
 
-cleanup_fclose:
-    fclose(file_handle);
-cleanup_return:
-    ;
+
+static uint64_t
+read_u64(uint8_t const *data, bool const is_big_endian)
+{
+    if (is_big_endian) {
+        return (uint64_t)read_u32(data, true) << 32 | read_u32(data + 4, true);
+    }
+    return (uint64_t)read_u32(data + 4, false) << 32 | read_u32(data, false);
 }
 
 
 /*!
-  Runs fotografiska with commandline arguments.
-  See top of the file for arguments.
+  Returns whether `date` looks like a real "YYYY:mm:dd HH:MM:SS" EXIF date. Cameras
+  that don't know the time sometimes write blanks or zeroes instead, and we'd rather
+  use the file's modification time than file those under year "0000".
   */
-int
-main(int argc, const char **argv)
+static bool
+is_valid_exif_date(char const *date)
 {
-    struct stat st;
-    char const *src_dir = NULL;
-    char *dest_dir = NULL;
-    bool is_dry_run;
-
-    struct argparse_option options[] = {
-        OPT_HELP(),
-        OPT_STRING('i', "src-dir", &src_dir, "a folder containing images/videos to read from"),
-        OPT_STRING('o', "dest-dir", &dest_dir, "a folder to move the files from src-dir into"),
-        OPT_BOOLEAN('d', "dry-run", &is_dry_run, "don't move files, just print out what would be done"),
-        OPT_END(),
-    };
+    char const *pattern = "dddd:dd:dd dd:dd:dd";
+    for (size_t idx = 0; pattern[idx] != '\0'; idx++) {
+        if (pattern[idx] == 'd') {
+            if (date[idx] < '0' || date[idx] > '9') {
+                return false;
+            }
+        } else if (date[idx] != pattern[idx]) {
+            return false;
+        }
+    }
+    return !pstr_starts_with(date, "0000");
+}
 
-    struct argparse argparse;
-    argparse_init(&argparse, options, USAGE_PARTS, 0);
-    argparse_describe(&argparse, USAGE_BODY, USAGE_EPILOGUE);
-    argc = argparse_parse(&argparse, argc, argv);
 
-    if (!src_dir || !dest_dir) {
-        argparse_usage(&argparse);
-        return 1;
+/*!
+  Copies an EXIF date into `date`, which must be at least 20 bytes, and formats it,
+  if it's a valid date.
+  */
+static bool
+use_exif_date(char const *exif_date, size_t const exif_date_size, char *date)
+{
+    char value[20] = {};
+    size_t const len = exif_date_size < 19 ? exif_date_size : 19;
+    memcpy(value, exif_date, len);
+    if (!is_valid_exif_date(value)) {
+        return false;
     }
+    memcpy(date, value, sizeof(value));
+    format_exif_date(date);
+    return true;
+}
 
-    pstr_rtrim_char(dest_dir, '/');
 
-    if (stat(src_dir, &st) != 0) {
-        printf("Source directory does not exist.\n");
-        return 1;
-    }
+/*!
+  Looks through the TIFF IFD at `ifd_offset` for an ASCII entry with tag `tag`, and
+  if it's a valid date, puts it into `date`. If `sub_ifd_offset` isn't NULL, it's set
+  to the offset of the Exif sub-IFD, if there is one.
+  */
+static bool
+get_tiff_ifd_date(
+    uint8_t const *tiff, size_t const tiff_size, bool const is_big_endian,
+    uint32_t const ifd_offset, uint16_t const tag, char *date, uint32_t *sub_ifd_offset
+) {
+    uint16_t const TIFF_TYPE_ASCII = 2;
+    uint16_t const TIFF_TAG_EXIF_IFD = 0x8769;
+    bool could_get_date = false;
 
-    if (stat(dest_dir, &st) != 0) {
-        printf("Destination directory does not exist.\n");
-        return 1;
+    if (ifd_offset > tiff_size || tiff_size - ifd_offset < 2) {
+        return false;
+    }
+    uint16_t const n_entries = read_u16(tiff + ifd_offset, is_big_endian);
+    if ((tiff_size - ifd_offset - 2) / 12 < n_entries) {
+        return false;
     }
 
-    size_t const file_buffer_size = MAX_HASHABLE_SIZE;
-    char *file_buffer = (char*)malloc(file_buffer_size);
-
-    printf("Reading files from %s\n", src_dir);
-    printf("This can sometimes take a moment\n");
-    tinydir_dir dir;
-    tinydir_open_sorted(&dir, src_dir);
-    // Disregard the . and .. entries
-    printf("%s: %zu files\n", src_dir, dir.n_files - 2);
+    for (uint16_t idx = 0; idx < n_entries; idx++) {
+        uint8_t const *entry = tiff + ifd_offset + 2 + idx * 12;
+        uint16_t const entry_tag = read_u16(entry, is_big_endian);
+        uint16_t const entry_type = read_u16(entry + 2, is_big_endian);
+        uint32_t const entry_count = read_u32(entry + 4, is_big_endian);
 
-    // Go through over every file in the directory, and try to put it in the right place
-    for (uint32_t idx = 0; idx < dir.n_files; idx++) {
-        tinydir_file file;
-        tinydir_readfile_n(&dir, &file, idx);
-        if (file.name[0] == '.' || file.is_dir) {
-            continue;
+        if (entry_tag == TIFF_TAG_EXIF_IFD && sub_ifd_offset) {
+            *sub_ifd_offset = read_u32(entry + 8, is_big_endian);
+        } else if (entry_tag == tag && entry_type == TIFF_TYPE_ASCII && !could_get_date) {
+            // Values of up to 4 bytes are stored in the entry itself
+            uint8_t const *value = entry + 8;
+            if (entry_count > 4) {
+                uint32_t const value_offset = read_u32(entry + 8, is_big_endian);
+                if (value_offset > tiff_size || tiff_size - value_offset < entry_count) {
+                    continue;
+                }
+                value = tiff + value_offset;
+            }
+            could_get_date = use_exif_date((char const*)value, entry_count, date);
         }
-        sort_file_into_dest_dir(&file, file_buffer, file_buffer_size, dest_dir, is_dry_run);
     }
 
-    tinydir_close(&dir);
+    return could_get_date;
+}
+
+
+/*!
+  Gets the date a photo was taken from the TIFF structure that EXIF data is stored in.
+  We prefer DateTime, which is what we've always used, and fall back to
+  DateTimeOriginal.
+  */
+static bool
+get_tiff_date(uint8_t const *tiff, size_t const tiff_size, char *date)
+{
+    uint16_t const TIFF_TAG_DATE_TIME = 0x0132;
+    uint16_t const TIFF_TAG_DATE_TIME_ORIGINAL = 0x9003;
+
+    if (tiff_size < 8) {
+        return false;
+    }
+    bool is_big_endian;
+    if (tiff[0] == 'I' && tiff[1] == 'I') {
+        is_big_endian = false;
+    } else if (tiff[0] == 'M' && tiff[1] == 'M') {
+        is_big_endian = true;
+    } else {
+        return false;
+    }
+    if (read_u16(tiff + 2, is_big_endian) != 42) {
+        return false;
+    }
 
-    return EXIT_SUCCESS;
+    uint32_t const ifd0_offset = read_u32(tiff + 4, is_big_endian);
+    uint32_t exif_ifd_offset = 0;
+    if (
+        get_tiff_ifd_date(tiff, tiff_size, is_big_endian, ifd0_offset,
+            TIFF_TAG_DATE_TIME, date, &exif_ifd_offset)
+    ) {
+        return true;
+    }
+    return exif_ifd_offset != 0 &&
+        get_tiff_ifd_date(tiff, tiff_size, is_big_endian, exif_ifd_offset,
+            TIFF_TAG_DATE_TIME_ORIGINAL, date, NULL);
 }
+
+
+/*!
+  Gets the EXIF date out of a JPEG by skipping from marker to marker until we find
+  the APP1 segment with the EXIF data in it. We stop once the image data starts,
+  since EXIF data always comes before it.
+  */
+static bool
+get_jpeg_date(struct file_view const *view, char *date)
+{
+    uint8_t const *data = view->data;
+    size_t const size = view->size;
+
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return false;
+    }
+
+    size_t pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) {
+            return false;
+        }
+        uint8_t const marker = data[pos + 1];
+        if (marker == 0xFF) {
+            // Markers can be padded with any number of 0xFFs
+            pos++;
+            continue;
+        }
+        if (marker == 0xD9 || marker == 0xDA) {
+            // End of image, or start of the actual image data
+            return false;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            // These markers don't have a length or any data
+            pos += 2;
+            continue;
+        }
+
+        size_t const segment_len = read_u16(data + pos + 2, true);
+        if (segment_len < 2 || pos + 2 + segment_len > size) {
+            return false;
+        }
+        uint8_t const *segment = data + pos + 4;
+        size_t const segment_size = segment_len - 2;
+        if (
+            marker == 0xE1 &&
+            segment_size > 6 &&
+            memcmp(segment, "Exif\0\0", 6) == 0 &&
+            get_tiff_date(segment + 6, segment_size - 6, date)
+        ) {
+            return true;
+        }
+        pos += 2 + segment_len;
+    }
+
+    return false;
+}
+
+
+/*!
+  A box in an ISO base media file, which is what MP4, MOV and HEIC files are made of.
+  */
+struct bmff_box {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t header_size;
+    char type[4];
+};
+
+
+/*!
+  Finds the first box of type `type` between `start` and `end` in the file behind
+  `view`. We only ever read box headers, so this can skip over huge boxes, like the
+  ones holding all the video data, without reading them.
+  */
+static bool
+find_bmff_box(
+    struct file_view const *view, uint64_t const start, uint64_t const end,
+    char const *type, struct bmff_box *box
+) {
+    uint8_t scratch[16];
+    uint64_t offset = start;
+
+    while (offset < end && end - offset >= 8) {
+        uint8_t const *header = get_file_bytes(view, offset, 8, scratch, sizeof(scratch));
+        if (!header) {
+            return false;
+        }
+        uint64_t size = read_u32(header, true);
+        uint64_t header_size = 8;
+        if (size == 1) {
+            // The real size is a 64-bit number after the type
+            header = get_file_bytes(view, offset, 16, scratch, sizeof(scratch));
+            if (!header) {
+                return false;
+            }
+            size = read_u64(header + 8, true);
+            header_size = 16;
+        } else if (size == 0) {
+            // This box goes on until the end
+            size = end - offset;
+        }
+        if (size < header_size || size > end - offset) {
+            return false;
+        }
+        if (memcmp(header + 4, type, 4) == 0) {
+            *box = (struct bmff_box){
+                .offset = offset, .size = size, .header_size = header_size,
+            };
+            memcpy(box->type, header + 4, 4);
+            return true;
+        }
+        offset += size;
+    }
+
+    return false;
+}
+
+
+/*!
+  Gets the creation time out of the movie header ("mvhd") box of an MP4 or MOV file.
+  This is stored in seconds since 1904, in UTC, and we keep it in UTC, so that like an
+  EXIF date, the same file always gets the same date, whatever time zone we're in.
+  */
+static bool
+get_bmff_movie_date(struct file_view const *view, char *date, size_t const date_size)
+{
+    uint64_t const SECONDS_FROM_1904_TO_1970 = 2082844800ULL;
+    struct bmff_box moov, mvhd;
+    uint8_t scratch[16];
+
+    if (
+        !find_bmff_box(view, 0, view->file_size, "moov", &moov) ||
+        !find_bmff_box(view, moov.offset + moov.header_size, moov.offset + moov.size,
+            "mvhd", &mvhd)
+    ) {
+        return false;
+    }
+
+    uint8_t const *mvhd_data = get_file_bytes(view, mvhd.offset + mvhd.header_size, 12,
+        scratch, sizeof(scratch));
+    if (!mvhd_data) {
+        return false;
+    }
+    uint64_t const creation_time = mvhd_data[0] == 1 ?
+        read_u64(mvhd_data + 4, true) : read_u32(mvhd_data + 4, true);
+
+    // Lots of cameras and phones just leave this as 0
+    if (creation_time <= SECONDS_FROM_1904_TO_1970) {
+        return false;
+    }
+
+    time_t const unix_time = (time_t)(creation_time - SECONDS_FROM_1904_TO_1970);
+    struct tm creation_date_tm = {};
+    gmtime_r(&unix_time, &creation_date_tm);
+    return strftime(date, date_size, "%Y.%m.%d_%H.%M.%S", &creation_date_tm) > 0;
+}
+
+
+/*!
+  Gets the EXIF date out of a HEIC file. The EXIF data is stored as an "item", so we
+  look up the ID of the item of type "Exif" in the item info ("iinf") box, then look
+  up where its data is in the item location ("iloc") box.
+  */
+static bool
+get_heic_date(struct file_view const *view, char *date)
+{
+    struct bmff_box meta, iinf, iloc;
+    uint8_t scratch[KB_TO_B(64)];
+
+    // "meta" is a full box, so it has 4 bytes of version and flags before its children
+    if (
+        !find_bmff_box(view, 0, view->file_size, "meta", &meta) ||
+        meta.size < meta.header_size + 4 ||
+        !find_bmff_box(view, meta.offset + meta.header_size + 4, meta.offset + meta.size,
+            "iinf", &iinf) ||
+        !find_bmff_box(view, meta.offset + meta.header_size + 4, meta.offset + meta.size,
+            "iloc", &iloc)
+    ) {
+        return false;
+    }
+
+    // Find the Exif item's ID
+    uint64_t const iinf_start = iinf.offset + iinf.header_size;
+    uint64_t const iinf_end = iinf.offset + iinf.size;
+    uint8_t const *iinf_data = get_file_bytes(view, iinf_start, 6, scratch, sizeof(scratch));
+    if (!iinf_data) {
+        return false;
+    }
+    uint64_t infe_start = iinf_start + (iinf_data[0] == 0 ? 6 : 8);
+    uint32_t exif_item_id = 0;
+    bool could_find_exif_item = false;
+    struct bmff_box infe;
+    while (
+        !could_find_exif_item &&
+        find_bmff_box(view, infe_start, iinf_end, "infe", &infe)
+    ) {
+        uint8_t const *infe_data = get_file_bytes(view, infe.offset + infe.header_size, 14,
+            scratch, sizeof(scratch));
+        if (infe_data && infe_data[0] == 2) {
+            exif_item_id = read_u16(infe_data + 4, true);
+            could_find_exif_item = memcmp(infe_data + 8, "Exif", 4) == 0;
+        } else if (infe_data && infe_data[0] == 3) {
+            exif_item_id = read_u32(infe_data + 4, true);
+            could_find_exif_item = memcmp(infe_data + 10, "Exif", 4) == 0;
+        }
+        infe_start = infe.offset + infe.size;
+    }
+    if (!could_find_exif_item) {
+        return false;
+    }
+
+    // Find where the Exif item is. This is the whole "iloc" box, so it has to fit in
+    // our scratch buffer, which it always does unless the file is very strange.
+    uint64_t const iloc_size = iloc.size - iloc.header_size;
+    uint8_t const *iloc_data = get_file_bytes(view, iloc.offset + iloc.header_size,
+        iloc_size, scratch, sizeof(scratch));
+    if (!iloc_data || iloc_size < 8) {
+        return false;
+    }
+    uint8_t const version = iloc_data[0];
+    uint8_t const offset_size = iloc_data[4] >> 4;
+    uint8_t const length_size = iloc_data[4] & 0xF;
+    uint8_t const base_offset_size = iloc_data[5] >> 4;
+    uint8_t const index_size = version >= 1 ? iloc_data[5] & 0xF : 0;
+    size_t pos = 6;
+    uint32_t n_items;
+    if (version < 2) {
+        n_items = read_u16(iloc_data + pos, true);
+        pos += 2;
+    } else {
+        n_items = read_u32(iloc_data + pos, true);
+        pos += 4;
+    }
+
+    // Reads a big-endian number that's `n_bytes` long, if there's enough data left
+    #define READ_ILOC_NUMBER(Value, N_Bytes) \
+        do { \
+            if ((N_Bytes) > iloc_size - pos) { return false; } \
+            (Value) = 0; \
+            for (size_t idx_byte = 0; idx_byte < (N_Bytes); idx_byte++) { \
+                (Value) = ((Value) << 8) | iloc_data[pos++]; \
+            } \
+        } while (0)
+
+    for (uint32_t idx_item = 0; idx_item < n_items; idx_item++) {
+        uint64_t item_id, construction_method = 0, data_reference_index, base_offset;
+        uint64_t n_extents, extent_index, extent_offset, extent_length;
+        READ_ILOC_NUMBER(item_id, version < 2 ? 2 : 4);
+        if (version >= 1) {
+            READ_ILOC_NUMBER(construction_method, 2);
+        }
+        READ_ILOC_NUMBER(data_reference_index, 2);
+        READ_ILOC_NUMBER(base_offset, base_offset_size);
+        READ_ILOC_NUMBER(n_extents, 2);
+        for (uint64_t idx_extent = 0; idx_extent < n_extents; idx_extent++) {
+            READ_ILOC_NUMBER(extent_index, index_size);
+            READ_ILOC_NUMBER(extent_offset, offset_size);
+            READ_ILOC_NUMBER(extent_length, length_size);
+
+            // We only understand items that are stored in one piece in this file
+            if (
+                item_id != exif_item_id || idx_extent != 0 ||
+                (construction_method & 0xF) != 0 || data_reference_index != 0
+            ) {
+                continue;
+            }
+
+            // The Exif item starts with the offset of the TIFF header, then the data
+            size_t const exif_size = extent_length < sizeof(scratch) ?
+                extent_length : sizeof(scratch);
+            uint8_t const *exif = get_file_bytes(view, base_offset + extent_offset,
+                exif_size, scratch, sizeof(scratch));
+            if (!exif || exif_size < 4) {
+                return false;
+            }
+            uint32_t const tiff_offset = read_u32(exif, true);
+            if (tiff_offset > exif_size - 4) {
+                return false;
+            }
+            return get_tiff_date(exif + 4 + tiff_offset, exif_size - 4 - tiff_offset, date);
+        }
+    }
+
+    #undef READ_ILOC_NUMBER
+
+    return false;
+}
+
+
+#if defined(USE_LIBEXIF)
+/*!
+  Gets the EXIF date using libexif, for files our own parser couldn't handle.
+  */
+static bool
+get_libexif_date(struct file_view const *view, char *date, size_t const date_size)
+{
+    size_t const exif_size = view->size < MAX_EXIF_SIZE ? view->size : MAX_EXIF_SIZE;
+    ExifData *exif_data = exif_data_new_from_data(view->data, exif_size);
+    if (!exif_data) {
+        return false;
+    }
+
+    char value[20] = {};
+    bool could_get_date =
+        (
+            get_exif_tag(exif_data, EXIF_IFD_0, EXIF_TAG_DATE_TIME, value, sizeof(value)) &&
+            use_exif_date(value, sizeof(value), date)
+        ) || (
+            get_exif_tag(exif_data, EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME_ORIGINAL,
+                value, sizeof(value)) &&
+            use_exif_date(value, sizeof(value), date)
+        );
+
+    exif_data_unref(exif_data);
+    return could_get_date;
+}
+#endif
+
+
+/*!
+  Gets the date a file was created from the file itself, using our own parser, which
+  only looks at the few bytes it needs and never allocates anything. We understand
+  EXIF data in JPEGs, TIFF-based files (like many raw formats) and HEIC files, as well
+  as the creation time of MP4 and MOV files. `date` must be at least 20 bytes.
+  */
+static bool
+get_builtin_date(struct file_view const *view, char *date, size_t const date_size)
+{
+    if (view->size >= 4 && view->data[0] == 0xFF && view->data[1] == 0xD8) {
+        return get_jpeg_date(view, date);
+    }
+    if (
+        view->size >= 4 &&
+        (memcmp(view->data, "II*\0", 4) == 0 || memcmp(view->data, "MM\0*", 4) == 0)
+    ) {
+        return get_tiff_date(view->data, view->size, date);
+    }
+    if (view->size >= 8 && memcmp(view->data + 4, "ftyp", 4) == 0) {
+        return get_heic_date(view, date) || get_bmff_movie_date(view, date, date_size);
+    }
+    return false;
+}
+
+
+/*!
+  Gets the date a file was created from the file itself, if we can, in the format we
+  use for new filenames. `date` must be at least 20 bytes.
+  */
+static bool
+get_embedded_date(struct file_view const *view, char *date, size_t const date_size)
+{
+    if (get_builtin_date(view, date, date_size)) {
+        return true;
+    }
+#if defined(USE_LIBEXIF)
+    return get_libexif_date(view, date, date_size);
+#else
+    return false;
+#endif
+}
+
+
+/*!
+  The ways we can hash files, see `get_file_hash()`. These are saved in the cache, so
+  new ones should only be added at the end.
+  */
+enum hash_kind {
+    HASH_XXH64,
+    HASH_XXH3_64,
+    HASH_XXH3_128,
+    HASH_SAMPLED,
+    HASH_FULL,
+};
+
+static char const * const HASH_KIND_NAMES[] = {
+    "xxh64", "xxh3-64", "xxh3-128", "sampled", "full",
+};
+
+
+/*!
+  Finds the hash kind called `name` in `HASH_KIND_NAMES`, and puts it into `kind`.
+  Returns false if there isn't one.
+  */
+static bool
+parse_hash_kind(char const *name, enum hash_kind *kind)
+{
+    for (size_t idx = 0; idx < sizeof(HASH_KIND_NAMES) / sizeof(HASH_KIND_NAMES[0]); idx++) {
+        if (pstr_eq(name, HASH_KIND_NAMES[idx])) {
+            *kind = (enum hash_kind)idx;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool
+is_128_bit_hash(enum hash_kind const kind)
+{
+    return kind == HASH_XXH3_128 || kind == HASH_SAMPLED || kind == HASH_FULL;
+}
+
+
+/*!
+  Returns how many bytes at the start of a file that is `file_size` bytes big we need
+  to have in memory to hash it with `kind`. Anything else we need, we read in chunks.
+  */
+static size_t
+get_hashable_size(enum hash_kind const kind, size_t const file_size)
+{
+    if (kind == HASH_SAMPLED && file_size > HASH_SAMPLE_SIZE * 2) {
+        return HASH_SAMPLE_SIZE;
+    }
+    return file_size < MAX_HASHABLE_SIZE ? file_size : MAX_HASHABLE_SIZE;
+}
+
+
+/*!
+  Reads the portion of the file at `path` that we need to hash it with `hash_kind` into
+  `view`, see `get_hashable_size()`. We try to `mmap()` the file if `can_mmap` is true,
+  and otherwise fall back to reading it into `*buffer`, which is allocated the first
+  time it's needed, and should be freed by the caller. Returns whether this succeeded.
+
+  `file_size` is from when we found the file, which might have been a while ago, so we
+  go by the size the file is now. If it has changed size since, we read it rather than
+  mapping it, since touching a mapped page past the end of a file that's shrinking
+  would crash us with SIGBUS.
+  */
+static bool
+open_file_view(
+    char const *path, size_t const file_size, enum hash_kind const hash_kind,
+    bool const can_mmap, char **buffer, struct file_view *view
+) {
+    *view = (struct file_view){.fd = -1};
+
+    int const fd = open(path, O_RDONLY | O_BINARY);
+    if (fd == -1) {
+        return false;
+    }
+    view->fd = fd;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close_file_view(view);
+        return false;
+    }
+    view->file_size = st.st_size;
+    view->size = get_hashable_size(hash_kind, view->file_size);
+    bool const has_changed_size = view->file_size != file_size;
+
+    // An empty file can't be mapped, but it's still a perfectly good file
+    if (view->size == 0) {
+        view->data = (uint8_t const*)"";
+        return true;
+    }
+
+#if !defined(_WIN32)
+    if (can_mmap && !has_changed_size) {
+        void *mapping = mmap(NULL, view->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            madvise(mapping, view->size, MADV_SEQUENTIAL);
+            view->mapping = mapping;
+            view->mapping_size = view->size;
+            view->data = (uint8_t const*)mapping;
+            return true;
+        }
+    }
+#endif
+
+    // Some filesystems won't let us map files, so read the file the old-fashioned way
+    if (!*buffer) {
+        *buffer = (char*)malloc(MAX_HASHABLE_SIZE);
+        if (!*buffer) {
+            close_file_view(view);
+            return false;
+        }
+    }
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fd, 0, view->size, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    size_t n_read = 0;
+    while (n_read < view->size) {
+        ssize_t const n_read_now = read(fd, *buffer + n_read, view->size - n_read);
+        if (n_read_now <= 0) {
+            close_file_view(view);
+            return false;
+        }
+        n_read += n_read_now;
+    }
+
+    view->data = (uint8_t const*)*buffer;
+    return true;
+}
+
+
+/*!
+  Adds the `size` bytes at `offset` in the file behind `view` to `state`, reading them
+  a chunk at a time if they're past the hashable portion. Returns false if we couldn't
+  read them all, for example because the file got shorter.
+  */
+static bool
+update_hash_from_file(
+    XXH3_state_t *state, struct file_view const *view, uint64_t offset, uint64_t size
+) {
+    uint8_t chunk[KB_TO_B(64)];
+    while (size > 0) {
+        size_t const chunk_size = size < sizeof(chunk) ? size : sizeof(chunk);
+        uint8_t const *data = get_file_bytes(view, offset, chunk_size, chunk, sizeof(chunk));
+        if (!data) {
+            return false;
+        }
+        XXH3_128bits_update(state, data, chunk_size);
+        offset += chunk_size;
+        size -= chunk_size;
+    }
+    return true;
+}
+
+
+/*!
+  Hashes the file behind `view` with `kind`, putting the result into `hash`. 64-bit
+  hashes leave `hash->high64` as 0. Returns false if we couldn't read the file.
+
+  * xxh64, xxh3-64 and xxh3-128 hash the first `MAX_HASHABLE_SIZE` bytes.
+  * sampled hashes the first and last `HASH_SAMPLE_SIZE` bytes, and the file size, so
+    it reads the same small amount no matter how big the file is.
+  * full hashes the whole file, reading it a chunk at a time past the hashable portion.
+  */
+static bool
+get_file_hash(struct file_view const *view, enum hash_kind const kind, XXH128_hash_t *hash)
+{
+    *hash = (XXH128_hash_t){};
+
+    if (kind == HASH_XXH64) {
+        hash->low64 = XXH64(view->data, view->size, 0);
+        return true;
+    } else if (kind == HASH_XXH3_64) {
+        hash->low64 = XXH3_64bits(view->data, view->size);
+        return true;
+    } else if (kind == HASH_XXH3_128) {
+        *hash = XXH3_128bits(view->data, view->size);
+        return true;
+    }
+
+    XXH3_state_t state;
+    XXH3_128bits_reset(&state);
+    XXH3_128bits_update(&state, view->data, view->size);
+
+    if (kind == HASH_SAMPLED) {
+        if (view->file_size > view->size) {
+            uint64_t const tail_offset = view->file_size - HASH_SAMPLE_SIZE;
+            if (!update_hash_from_file(&state, view, tail_offset, HASH_SAMPLE_SIZE)) {
+                return false;
+            }
+        }
+        // Always little endian, so that the same file gets the same hash anywhere
+        uint8_t file_size_bytes[8];
+        for (size_t idx = 0; idx < sizeof(file_size_bytes); idx++) {
+            file_size_bytes[idx] = (uint8_t)((uint64_t)view->file_size >> (idx * 8));
+        }
+        XXH3_128bits_update(&state, file_size_bytes, sizeof(file_size_bytes));
+    } else if (kind == HASH_FULL) {
+        if (!update_hash_from_file(&state, view, view->size, view->file_size - view->size)) {
+            return false;
+        }
+    }
+
+    *hash = XXH3_128bits_digest(&state);
+    return true;
+}
+
+
+/*!
+  Puts `hash` into `str` as lowercase hex, as it appears in filenames. We've always
+  written 64-bit hashes without leading zeros, so we keep doing that. 128-bit hashes
+  always get all 32 digits.
+  */
+static bool
+format_hash(char *str, size_t const str_size, XXH128_hash_t const hash, bool const is_128_bit)
+{
+    size_t high_len = 0;
+    if (is_128_bit) {
+        if (!pstr_from_uint64_hex(str, str_size, hash.high64, 16, &high_len)) {
+            return false;
+        }
+    }
+    size_t low_len;
+    return pstr_from_uint64_hex(str + high_len, str_size - high_len, hash.low64,
+        is_128_bit ? 16 : 1, &low_len);
+}
+
+
+/*!
+  The parts of a run we time separately with `--stats`. Reading, finding the date and
+  hashing are timed for each file we actually read, scanning for each folder, and
+  moving for each file we try to move.
+  */
+enum stats_phase {
+    PHASE_SCAN,
+    PHASE_READ,
+    PHASE_DATE,
+    PHASE_HASH,
+    PHASE_MOVE,
+    N_PHASES,
+};
+
+static char const * const PHASE_NAMES[] = {"scan", "read", "date", "hash", "move"};
+
+// Latencies are counted in buckets an eighth of a power of two wide, so we can work out
+// percentiles to within 12.5% without keeping every latency around
+#define N_LATENCY_BUCKETS (62 * 8)
+
+
+/*!
+  How long something took, in wall clock time and CPU time of the thread doing it.
+  */
+struct timing {
+    bool is_set;
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+};
+
+struct stopwatch {
+    bool is_on;
+    uint64_t wall_start_ns;
+    uint64_t cpu_start_ns;
+};
+
+/*!
+  Everything we know about how long one phase took, over the whole run.
+  */
+struct phase_stats {
+    uint64_t n_samples;
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+    uint64_t max_ns;
+    uint64_t latency_counts[N_LATENCY_BUCKETS];
+};
+
+/*!
+  What we print with `--stats`. Everything is added up on the thread that commits
+  files, or, for scanning, merged in once the scanners have finished.
+  */
+struct stats {
+    struct timing run_timing;
+    struct timing setup_timing;
+    struct phase_stats phases[N_PHASES];
+    uint64_t n_files;
+    uint64_t n_bytes_read;
+    uint64_t n_cached;
+    uint64_t n_embedded_dates;
+    uint64_t n_mtime_dates;
+    uint64_t n_moved;
+    uint64_t n_duplicates;
+    uint64_t n_already_there;
+    uint64_t n_errors;
+};
+
+
+static uint64_t
+get_time_ns(clockid_t const clock)
+{
+    struct timespec ts = {};
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+/*!
+  Starts timing something, but only if `is_on`, so that we don't even look at the
+  clock when we're not keeping stats.
+  */
+static void
+start_stopwatch(struct stopwatch *stopwatch, bool const is_on)
+{
+    stopwatch->is_on = is_on;
+    if (is_on) {
+        stopwatch->wall_start_ns = get_time_ns(CLOCK_MONOTONIC);
+        stopwatch->cpu_start_ns = get_time_ns(CLOCK_THREAD_CPUTIME_ID);
+    }
+}
+
+
+/*!
+  Adds the time since `start_stopwatch()` to `timing`, so that something we time in
+  a few goes adds up to one timing.
+  */
+static void
+stop_stopwatch(struct stopwatch const *stopwatch, struct timing *timing)
+{
+    if (!stopwatch->is_on) {
+        return;
+    }
+    timing->is_set = true;
+    timing->wall_ns += get_time_ns(CLOCK_MONOTONIC) - stopwatch->wall_start_ns;
+    timing->cpu_ns += get_time_ns(CLOCK_THREAD_CPUTIME_ID) - stopwatch->cpu_start_ns;
+}
+
+
+static size_t
+get_latency_bucket(uint64_t const ns)
+{
+    if (ns < 8) {
+        return (size_t)ns;
+    }
+    int const power = 63 - __builtin_clzll(ns);
+    return (size_t)(power - 2) * 8 + (size_t)((ns >> (power - 3)) & 7);
+}
+
+
+/*!
+  Returns the highest latency that goes in bucket `idx`.
+  */
+static uint64_t
+get_latency_bucket_max(size_t const idx)
+{
+    if (idx < 8) {
+        return idx;
+    }
+    int const power = (int)(idx / 8) + 2;
+    uint64_t const width = (uint64_t)1 << (power - 3);
+    return (8 + idx % 8) * width + (width - 1);
+}
+
+
+static void
+add_phase_sample(struct phase_stats *phase, struct timing const *timing)
+{
+    if (!timing->is_set) {
+        return;
+    }
+    phase->n_samples++;
+    phase->wall_ns += timing->wall_ns;
+    phase->cpu_ns += timing->cpu_ns;
+    if (timing->wall_ns > phase->max_ns) {
+        phase->max_ns = timing->wall_ns;
+    }
+    phase->latency_counts[get_latency_bucket(timing->wall_ns)]++;
+}
+
+
+static void
+merge_phase_stats(struct phase_stats *phase, struct phase_stats const *other)
+{
+    phase->n_samples += other->n_samples;
+    phase->wall_ns += other->wall_ns;
+    phase->cpu_ns += other->cpu_ns;
+    if (other->max_ns > phase->max_ns) {
+        phase->max_ns = other->max_ns;
+    }
+    for (size_t idx = 0; idx < N_LATENCY_BUCKETS; idx++) {
+        phase->latency_counts[idx] += other->latency_counts[idx];
+    }
+}
+
+
+/*!
+  Returns the latency that `percentile` percent of samples in `phase` took at most.
+  */
+static uint64_t
+get_latency_percentile(struct phase_stats const *phase, double const percentile)
+{
+    if (phase->n_samples == 0) {
+        return 0;
+    }
+    uint64_t const n_wanted = (uint64_t)((double)phase->n_samples * percentile / 100.0 + 0.5);
+    uint64_t n_seen = 0;
+    for (size_t idx = 0; idx < N_LATENCY_BUCKETS; idx++) {
+        n_seen += phase->latency_counts[idx];
+        if (n_seen >= n_wanted && n_seen > 0) {
+            uint64_t const bucket_max = get_latency_bucket_max(idx);
+            return bucket_max < phase->max_ns ? bucket_max : phase->max_ns;
+        }
+    }
+    return phase->max_ns;
+}
+
+
+/*!
+  Everything we need to know to put a file in its new home. We work this out
+  separately from actually moving the file, so that the expensive part (reading and
+  hashing) can happen on any thread, while the moving always happens in order.
+  */
+struct file_plan {
+    bool is_ok;
+    char error[MAX_PATH + 128];
+    char file_new_name[MAX_PATH];
+    char file_creation_year[5]; // YYYY0
+    char file_creation_month[3]; // mm0
+    // Kept around so that we can remember them in the cache
+    bool is_cached;
+    enum hash_kind hash_kind;
+    XXH128_hash_t hash;
+    char embedded_date[20]; // YYYY.mm.dd_HH.MM.SS0, or empty if the file had no date
+    // Only filled in if we're keeping stats
+    bool is_timed;
+    struct timing timings[N_PHASES];
+    uint64_t n_bytes_read;
+};
+
+
+/*!
+  The cache remembers the hash and embedded date of files we've already read, so that if
+  they're still in the source dir next time (for example because they already existed
+  in the destination dir), we don't have to read them again. Files are recognised by
+  their device, inode, size and modification time, so if any of those change, or we're
+  hashing files a different way, we read the file again.
+
+  The cache file is a `struct cache_header` followed by `n_entries` `struct
+  cache_entry`s sorted by device and inode. It's in native byte order, so we can map
+  it straight into memory and binary search it. It's only meant to be read by the
+  machine that wrote it.
+
+  We only write down files that are still in the source dir at the end of a run, so
+  the cache stays about as big as the source dir.
+  */
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t n_entries;
+};
+
+struct cache_entry {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash_low;
+    uint64_t hash_high;
+    char embedded_date[20]; // YYYY.mm.dd_HH.MM.SS0, or empty if the file had no date
+    uint32_t hash_kind;
+};
+
+struct cache {
+    char path[MAX_PATH];
+    // The entries we loaded, which are never changed, so can be read from any thread
+    void *mapping;
+    size_t mapping_size;
+    struct cache_entry const *entries;
+    size_t n_entries;
+    // The entries we'll save at the end, which are only touched when committing
+    struct cache_entry *new_entries;
+    size_t n_new_entries;
+    size_t new_entries_cap;
+    size_t n_hits;
+    size_t n_misses;
+};
+
+
+/*!
+  Everything about the current run that we need to handle each file we find.
+  */
+struct run {
+    char const *dest_dir;
+    bool is_dry_run;
+    // Whether to leave out the line we usually print for each file
+    bool is_quiet;
+    enum hash_kind hash_kind;
+    // NULL if we're not using the cache
+    struct cache *cache;
+    // NULL if we're not checking for duplicates
+    struct hash_index *index;
+    // Where we actually move files, kept open
+    struct target_dir dest_dir_target;
+    // NULL if we're leaving duplicates where they are
+    struct target_dir *duplicates_dir;
+    // NULL if we're not running in parallel
+    struct worker_pool *pool;
+    // NULL if we're not using io_uring
+    struct uring_engine *uring;
+    // NULL if we're not keeping stats
+    struct stats *stats;
+    // NULL if we're moving files straight away, rather than writing down what to do
+    // with them first
+    struct journal *journal;
+    // Only used if we can't map files, see `open_file_view()`
+    char *file_buffer;
+};
+
+
+static int64_t
+get_mtime_nsec(struct stat const *st)
+{
+#if defined(_WIN32)
+    return 0;
+#else
+    return st->st_mtim.tv_nsec;
+#endif
+}
+
+
+static int
+compare_cache_entries(void const *a, void const *b)
+{
+    struct cache_entry const *entry_a = (struct cache_entry const*)a;
+    struct cache_entry const *entry_b = (struct cache_entry const*)b;
+    if (entry_a->dev != entry_b->dev) {
+        return entry_a->dev < entry_b->dev ? -1 : 1;
+    }
+    if (entry_a->ino != entry_b->ino) {
+        return entry_a->ino < entry_b->ino ? -1 : 1;
+    }
+    return 0;
+}
+
+
+/*!
+  Loads the cache in `dest_dir` into `cache`. If there is no cache yet, or it's from
+  an older version, we start with an empty one. Returns false if something went
+  wrong while reading it, in which case `cache` is still usable, but empty.
+  */
+static bool
+load_cache(struct cache *cache, char const *dest_dir)
+{
+    *cache = (struct cache){};
+    if (!pstr_vcat(cache->path, MAX_PATH, dest_dir, "/", CACHE_FILE_NAME, NULL)) {
+        return false;
+    }
+
+    int const fd = open(cache->path, O_RDONLY | O_BINARY);
+    if (fd == -1) {
+        return true;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t const file_size = st.st_size;
+    if (file_size < sizeof(struct cache_header)) {
+        close(fd);
+        return true;
+    }
+
+#if !defined(_WIN32)
+    void *mapping = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+#else
+    void *mapping = malloc(file_size);
+    if (!mapping || read(fd, mapping, file_size) != (ssize_t)file_size) {
+        free(mapping);
+        close(fd);
+        return false;
+    }
+#endif
+    close(fd);
+    cache->mapping = mapping;
+    cache->mapping_size = file_size;
+
+    struct cache_header const *header = (struct cache_header const*)mapping;
+    if (
+        memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+        header->version != CACHE_VERSION ||
+        header->entry_size != sizeof(struct cache_entry) ||
+        header->n_entries != (file_size - sizeof(struct cache_header)) /
+            sizeof(struct cache_entry)
+    ) {
+        // This isn't a cache we understand, so just start over
+        return true;
+    }
+
+    cache->entries = (struct cache_entry const*)(header + 1);
+    cache->n_entries = header->n_entries;
+    return true;
+}
+
+
+/*!
+  Returns the cache entry for the file with stat info `st`, hashed with `hash_kind`, or
+  NULL if we don't have one or the file has changed since. This is safe to call from
+  any thread.
+  */
+static struct cache_entry const *
+find_in_cache(
+    struct cache const *cache, struct stat const *st, enum hash_kind const hash_kind
+) {
+    if (cache->n_entries == 0) {
+        return NULL;
+    }
+    struct cache_entry const key = {.dev = st->st_dev, .ino = st->st_ino};
+    struct cache_entry const *entry = (struct cache_entry const*)bsearch(
+        &key, cache->entries, cache->n_entries, sizeof(struct cache_entry),
+        compare_cache_entries);
+    if (
+        !entry ||
+        entry->size != (uint64_t)st->st_size ||
+        entry->mtime_sec != (int64_t)st->st_mtime ||
+        entry->mtime_nsec != get_mtime_nsec(st) ||
+        entry->hash_kind != (uint32_t)hash_kind
+    ) {
+        return NULL;
+    }
+    return entry;
+}
+
+
+/*!
+  Remembers `plan` for the file with stat info `st`, so that it's saved next time we
+  call `save_cache()`.
+  */
+static bool
+add_to_cache(struct cache *cache, struct stat const *st, struct file_plan const *plan)
+{
+    if (cache->n_new_entries == cache->new_entries_cap) {
+        size_t const new_cap = cache->new_entries_cap ? cache->new_entries_cap * 2 : 1024;
+        struct cache_entry *new_entries = (struct cache_entry*)realloc(
+            cache->new_entries, new_cap * sizeof(struct cache_entry));
+        if (!new_entries) {
+            return false;
+        }
+        cache->new_entries = new_entries;
+        cache->new_entries_cap = new_cap;
+    }
+
+    struct cache_entry *entry = &cache->new_entries[cache->n_new_entries++];
+    *entry = (struct cache_entry){
+        .dev = st->st_dev,
+        .ino = st->st_ino,
+        .size = st->st_size,
+        .mtime_sec = st->st_mtime,
+        .mtime_nsec = get_mtime_nsec(st),
+        .hash_low = plan->hash.low64,
+        .hash_high = plan->hash.high64,
+        .hash_kind = plan->hash_kind,
+    };
+    memcpy(entry->embedded_date, plan->embedded_date, sizeof(entry->embedded_date));
+    return true;
+}
+
+
+/*!
+  Writes the entries we've added during this run to the cache file. We write a
+  temporary file and rename it over the old one, so that if we're interrupted, we
+  either have the old cache or the new one, and never half of one.
+  */
+static bool
+save_cache(struct cache *cache)
+{
+    char tmp_path[MAX_PATH] = {};
+    if (!pstr_vcat(tmp_path, MAX_PATH, cache->path, ".tmp", NULL)) {
+        return false;
+    }
+
+    if (cache->n_new_entries > 0) {
+        qsort(cache->new_entries, cache->n_new_entries, sizeof(struct cache_entry),
+            compare_cache_entries);
+    }
+
+    FILE *file_handle = fopen(tmp_path, "wb");
+    if (!file_handle) {
+        return false;
+    }
+
+    struct cache_header header = {
+        .version = CACHE_VERSION,
+        .entry_size = sizeof(struct cache_entry),
+        .n_entries = cache->n_new_entries,
+    };
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+
+    bool const could_write =
+        fwrite(&header, sizeof(header), 1, file_handle) == 1 &&
+        (
+            cache->n_new_entries == 0 ||
+            fwrite(cache->new_entries, sizeof(struct cache_entry), cache->n_new_entries,
+                file_handle) == cache->n_new_entries
+        ) &&
+        fflush(file_handle) == 0 &&
+        fsync(fileno(file_handle)) == 0;
+    if (fclose(file_handle) != 0 || !could_write) {
+        remove(tmp_path);
+        return false;
+    }
+
+    return rename(tmp_path, cache->path) == 0;
+}
+
+
+static void
+free_cache(struct cache *cache)
+{
+#if !defined(_WIN32)
+    if (cache->mapping) {
+        munmap(cache->mapping, cache->mapping_size);
+    }
+#else
+    free(cache->mapping);
+#endif
+    free(cache->new_entries);
+    *cache = (struct cache){};
+}
+
+
+/*!
+  A set of the hashes of every file in the destination dir, so that we can tell if a
+  file is already there, even if it has a different name or date.
+
+  This is an open addressing hash table that only stores the hashes themselves, one
+  after another, so that it stays small and fast even with millions of files. The
+  hashes are already evenly spread out, so we use their low bits as the slot index
+  directly. 64-bit hashes are stored with a `high64` of 0. An empty slot is all 0, so
+  we keep track of a hash of 0 separately.
+  */
+struct hash_index {
+    XXH128_hash_t *slots;
+    size_t n_slots; // Always a power of two
+    size_t n_hashes;
+    bool has_zero;
+};
+
+
+static bool
+is_zero_hash(XXH128_hash_t const hash)
+{
+    return hash.low64 == 0 && hash.high64 == 0;
+}
+
+
+static bool
+is_in_hash_index(struct hash_index const *index, XXH128_hash_t const hash)
+{
+    if (is_zero_hash(hash)) {
+        return index->has_zero;
+    }
+    if (index->n_slots == 0) {
+        return false;
+    }
+    size_t const mask = index->n_slots - 1;
+    for (
+        size_t idx = hash.low64 & mask;
+        !is_zero_hash(index->slots[idx]);
+        idx = (idx + 1) & mask
+    ) {
+        if (XXH128_isEqual(index->slots[idx], hash)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*!
+  Adds `hash` to `index`, growing it if it's getting too full.
+  Returns false if we couldn't allocate enough memory.
+  */
+static bool
+add_to_hash_index(struct hash_index *index, XXH128_hash_t const hash)
+{
+    if (is_zero_hash(hash)) {
+        index->has_zero = true;
+        return true;
+    }
+
+    // Keep the table at most half full, so that probe sequences stay short
+    if ((index->n_hashes + 1) * 2 > index->n_slots) {
+        size_t const new_n_slots = index->n_slots ? index->n_slots * 2 : 1024;
+        XXH128_hash_t *new_slots = (XXH128_hash_t*)calloc(new_n_slots,
+            sizeof(XXH128_hash_t));
+        if (!new_slots) {
+            return false;
+        }
+        size_t const new_mask = new_n_slots - 1;
+        for (size_t idx_old = 0; idx_old < index->n_slots; idx_old++) {
+            XXH128_hash_t const old_hash = index->slots[idx_old];
+            if (is_zero_hash(old_hash)) {
+                continue;
+            }
+            size_t idx = old_hash.low64 & new_mask;
+            while (!is_zero_hash(new_slots[idx])) {
+                idx = (idx + 1) & new_mask;
+            }
+            new_slots[idx] = old_hash;
+        }
+        free(index->slots);
+        index->slots = new_slots;
+        index->n_slots = new_n_slots;
+    }
+
+    size_t const mask = index->n_slots - 1;
+    size_t idx = hash.low64 & mask;
+    while (!is_zero_hash(index->slots[idx])) {
+        if (XXH128_isEqual(index->slots[idx], hash)) {
+            return true;
+        }
+        idx = (idx + 1) & mask;
+    }
+    index->slots[idx] = hash;
+    index->n_hashes++;
+    return true;
+}
+
+
+static void
+free_hash_index(struct hash_index *index)
+{
+    free(index->slots);
+    *index = (struct hash_index){};
+}
+
+
+static bool
+is_all_digits(char const *str, size_t const len)
+{
+    if ((size_t)pstr_len(str) != len) {
+        return false;
+    }
+    for (size_t idx = 0; idx < len; idx++) {
+        if (str[idx] < '0' || str[idx] > '9') {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*!
+  Gets the hash out of a filename we've made, which looks like
+  "YYYY.mm.dd_HH.MM.SS_hash_name.ext". The hash has up to 16 hex digits for 64-bit
+  hashes and 32 for 128-bit ones. Returns false if the name doesn't look like one of
+  ours.
+  */
+static bool
+parse_hash_from_file_name(char const *name, XXH128_hash_t *hash)
+{
+    size_t const date_len = 19; // YYYY.mm.dd_HH.MM.SS
+    if ((size_t)pstr_len(name) <= date_len + 1 || name[date_len] != '_') {
+        return false;
+    }
+    char const *hash_start = name + date_len + 1;
+    XXH128_hash_t value = {};
+    size_t n_digits = 0;
+    for (; hash_start[n_digits] != '_'; n_digits++) {
+        char const c = hash_start[n_digits];
+        uint64_t digit;
+        if (n_digits == 32) {
+            return false;
+        } else if (c >= '0' && c <= '9') {
+            digit = (uint64_t)(c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            digit = (uint64_t)(c - 'a' + 10);
+        } else {
+            return false;
+        }
+        value.high64 = (value.high64 << 4) | (value.low64 >> 60);
+        value.low64 = (value.low64 << 4) | digit;
+    }
+    if (n_digits == 0) {
+        return false;
+    }
+    *hash = value;
+    return true;
+}
+
+
+/*!
+  Builds `index` by going through the YYYY/mm/ folders in `dest_dir` and reading
+  the hash out of the name of each file in them. We only read directory entries, and
+  never `stat()` or open any files, so this is quick even for huge destination dirs.
+  */
+static bool
+build_hash_index(struct hash_index *index, char const *dest_dir)
+{
+    *index = (struct hash_index){};
+
+    DIR *dest = opendir(dest_dir);
+    if (!dest) {
+        return false;
+    }
+
+    bool did_succeed = true;
+    struct dirent *year_entry;
+    while (did_succeed && (year_entry = readdir(dest)) != NULL) {
+        if (!is_all_digits(year_entry->d_name, 4)) {
+            continue;
+        }
+        char year_directory[MAX_PATH] = {};
+        if (!pstr_vcat(year_directory, MAX_PATH, dest_dir, "/", year_entry->d_name, NULL)) {
+            continue;
+        }
+        DIR *year = opendir(year_directory);
+        if (!year) {
+            continue;
+        }
+
+        struct dirent *month_entry;
+        while (did_succeed && (month_entry = readdir(year)) != NULL) {
+            if (!is_all_digits(month_entry->d_name, 2)) {
+                continue;
+            }
+            char month_directory[MAX_PATH] = {};
+            if (
+                !pstr_vcat(month_directory, MAX_PATH, year_directory, "/",
+                    month_entry->d_name, NULL)
+            ) {
+                continue;
+            }
+            DIR *month = opendir(month_directory);
+            if (!month) {
+                continue;
+            }
+
+            struct dirent *file_entry;
+            while (did_succeed && (file_entry = readdir(month)) != NULL) {
+                XXH128_hash_t hash;
+                if (parse_hash_from_file_name(file_entry->d_name, &hash)) {
+                    did_succeed = add_to_hash_index(index, hash);
+                }
+            }
+            closedir(month);
+        }
+        closedir(year);
+    }
+    closedir(dest);
+
+    return did_succeed;
+}
+
+
+/*!
+  The journal lets us split a run in two: first we plan what to do with every file and
+  write it down, then we carry out the plan. If we're interrupted while carrying it out,
+  the next run picks up where we left off using only what's written down, so we don't
+  have to look inside any of the files again.
+
+  The journal file is a `struct journal_header` followed by records. Each record is a
+  `struct journal_record` followed by `size` bytes, padded to a multiple of 8 bytes so
+  that the next record is aligned. There are four kinds of record:
+
+  * `JOURNAL_START` comes first, followed by the absolute path of the duplicates dir,
+    or an empty string if we're leaving duplicates where they are.
+  * `JOURNAL_MOVE` is what we've planned for one file: a `struct journal_move`, followed
+    by the file's absolute path and its new name.
+  * `JOURNAL_PLANNED` means we've planned every file, and has nothing after it.
+  * `JOURNAL_DONE` is a `struct journal_done`, which says we've carried out a move.
+
+  We only ever add records to the end, and `fsync()` the journal every
+  `JOURNAL_N_RECORDS_PER_SYNC` records. If we're interrupted while writing a record,
+  its checksum won't match, so we ignore it and everything after it. Moving a file is a
+  single rename, so each file is always either in its old home or its new one. If we
+  moved a file but hadn't written that down yet, we'll find it in its new home next
+  time, so we know that move is done.
+
+  Like the cache, the journal is in native byte order, and only meant to be read by the
+  machine that wrote it.
+  */
+enum journal_record_kind {
+    JOURNAL_START = 1,
+    JOURNAL_MOVE,
+    JOURNAL_PLANNED,
+    JOURNAL_DONE,
+};
+
+/*!
+  Where a file in the journal is going.
+  */
+enum journal_target {
+    JOURNAL_TARGET_DEST,
+    JOURNAL_TARGET_DUPLICATES,
+    // It's a duplicate we're leaving where it is
+    JOURNAL_TARGET_NONE,
+};
+
+struct journal_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t move_size;
+};
+
+struct journal_record {
+    uint32_t kind;
+    uint32_t size;
+    uint64_t checksum; // XXH64 of the `size` bytes after this, seeded with kind and size
+};
+
+struct journal_move {
+    // What the file looked like when we planned its move, so we can tell if it's changed
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash_low;
+    uint64_t hash_high;
+    uint32_t hash_kind;
+    uint32_t target; // enum journal_target
+    char file_creation_year[5]; // YYYY0
+    char file_creation_month[3]; // mm0
+    // Both of these include the terminating 0
+    uint32_t source_path_size;
+    uint32_t file_new_name_size;
+};
+
+struct journal_done {
+    uint64_t move_idx; // Moves are numbered in the order they're in the journal
+    uint32_t result; // enum move_result
+    uint32_t padding;
+};
+
+/*!
+  A move we've loaded from the journal. Everything points into the journal's mapping.
+  */
+struct journal_entry {
+    struct journal_move const *move;
+    char const *source_path;
+    char const *file_new_name;
+    uint64_t idx;
+    bool is_done;
+};
+
+struct journal {
+    char path[MAX_PATH];
+    // Source paths that aren't absolute are relative to this
+    char cwd[MAX_PATH];
+    // Open for adding records to, once we've started or loaded a journal
+    FILE *file_handle;
+    size_t n_unsynced_records;
+    bool is_started;
+    bool is_planned;
+    uint64_t n_moves;
+    uint64_t n_done;
+    // What we loaded, which is only touched on the thread that commits files
+    void *mapping;
+    size_t mapping_size;
+    char const *duplicates_dir; // Empty if we're leaving duplicates where they are
+    struct journal_entry *entries;
+};
+
+
+static size_t
+get_journal_padded_size(size_t const size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+
+static uint64_t
+get_journal_checksum(uint32_t const kind, void const *data, uint32_t const size)
+{
+    return XXH64(data, size, ((uint64_t)kind << 32) | size);
+}
+
+
+/*!
+  Puts the absolute version of `path` into `absolute_path`, which is `MAX_PATH` long.
+  */
+static bool
+get_journal_absolute_path(struct journal const *journal, char const *path, char *absolute_path)
+{
+    if (path[0] == '/') {
+        return pstr_copy(absolute_path, MAX_PATH, path);
+    }
+    return pstr_vcat(absolute_path, MAX_PATH, journal->cwd, "/", path, NULL);
+}
+
+
+/*!
+  Makes sure everything we've added to the journal is on the disk.
+  */
+static bool
+sync_journal(struct journal *journal)
+{
+    journal->n_unsynced_records = 0;
+    return fflush(journal->file_handle) == 0 && fsync(fileno(journal->file_handle)) == 0;
+}
+
+
+/*!
+  Adds a record of `kind` to the end of the journal, followed by `size` bytes of `data`,
+  and `fsync()`s the journal if it's time to.
+  */
+static bool
+add_journal_record(
+    struct journal *journal, enum journal_record_kind const kind, void const *data,
+    uint32_t const size
+) {
+    static uint8_t const padding[8] = {};
+    struct journal_record const record = {
+        .kind = kind,
+        .size = size,
+        .checksum = get_journal_checksum(kind, data, size),
+    };
+    size_t const padding_size = get_journal_padded_size(size) - size;
+    if (
+        fwrite(&record, sizeof(record), 1, journal->file_handle) != 1 ||
+        (size > 0 && fwrite(data, size, 1, journal->file_handle) != 1) ||
+        (padding_size > 0 && fwrite(padding, padding_size, 1, journal->file_handle) != 1)
+    ) {
+        return false;
+    }
+    journal->n_unsynced_records++;
+    return journal->n_unsynced_records < JOURNAL_N_RECORDS_PER_SYNC || sync_journal(journal);
+}
+
+
+/*!
+  Starts a new journal in `dest_dir`, for a run that moves duplicates into
+  `duplicates_dir`, or leaves them where they are if it's NULL. There mustn't be a
+  journal there already.
+  */
+static bool
+start_journal(struct journal *journal, char const *dest_dir, char const *duplicates_dir)
+{
+    *journal = (struct journal){};
+    char duplicates_dir_path[MAX_PATH] = {};
+    if (
+        !pstr_vcat(journal->path, MAX_PATH, dest_dir, "/", JOURNAL_FILE_NAME, NULL) ||
+        !getcwd(journal->cwd, MAX_PATH) ||
+        (duplicates_dir &&
+            !get_journal_absolute_path(journal, duplicates_dir, duplicates_dir_path))
+    ) {
+        return false;
+    }
+
+    journal->file_handle = fopen(journal->path, "wbx");
+    if (!journal->file_handle) {
+        return false;
+    }
+
+    struct journal_header header = {
+        .version = JOURNAL_VERSION,
+        .move_size = sizeof(struct journal_move),
+    };
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+
+    journal->is_started =
+        fwrite(&header, sizeof(header), 1, journal->file_handle) == 1 &&
+        add_journal_record(journal, JOURNAL_START, duplicates_dir_path,
+            pstr_len(duplicates_dir_path) + 1) &&
+        sync_journal(journal);
+    return journal->is_started;
+}
+
+
+/*!
+  Writes down that we're going to move `file` to `target`, as worked out in `plan`.
+  */
+static bool
+add_move_to_journal(
+    struct journal *journal, tinydir_file const *file, struct file_plan const *plan,
+    enum journal_target const target
+) {
+    char source_path[MAX_PATH] = {};
+    if (!get_journal_absolute_path(journal, file->path, source_path)) {
+        return false;
+    }
+    uint32_t const source_path_size = pstr_len(source_path) + 1;
+    uint32_t const file_new_name_size = pstr_len(plan->file_new_name) + 1;
+
+    struct journal_move move = {
+        .dev = file->_s.st_dev,
+        .ino = file->_s.st_ino,
+        .size = file->_s.st_size,
+        .mtime_sec = file->_s.st_mtime,
+        .mtime_nsec = get_mtime_nsec(&file->_s),
+        .hash_low = plan->hash.low64,
+        .hash_high = plan->hash.high64,
+        .hash_kind = plan->hash_kind,
+        .target = target,
+        .source_path_size = source_path_size,
+        .file_new_name_size = file_new_name_size,
+    };
+    memcpy(move.file_creation_year, plan->file_creation_year, sizeof(move.file_creation_year));
+    memcpy(move.file_creation_month, plan->file_creation_month,
+        sizeof(move.file_creation_month));
+
+    uint8_t data[sizeof(struct journal_move) + 2 * MAX_PATH];
+    memcpy(data, &move, sizeof(move));
+    memcpy(data + sizeof(move), source_path, source_path_size);
+    memcpy(data + sizeof(move) + source_path_size, plan->file_new_name, file_new_name_size);
+    if (
+        !add_journal_record(journal, JOURNAL_MOVE, data,
+            sizeof(move) + source_path_size + file_new_name_size)
+    ) {
+        return false;
+    }
+    journal->n_moves++;
+    return true;
+}
+
+
+/*!
+  Writes down that we've planned every file, so the plan is complete.
+  */
+static bool
+finish_journal_plan(struct journal *journal)
+{
+    journal->is_planned =
+        add_journal_record(journal, JOURNAL_PLANNED, NULL, 0) && sync_journal(journal);
+    return journal->is_planned;
+}
+
+
+static bool
+is_terminated_string(char const *str, uint32_t const size)
+{
+    return size > 0 && str[size - 1] == '\0';
+}
+
+
+/*!
+  Adds a record we've loaded to `journal`. Returns false if it doesn't make sense, in
+  which case we stop reading the journal there.
+  */
+static bool
+add_loaded_journal_record(
+    struct journal *journal, struct journal_record const *record, uint8_t const *data
+) {
+    if (record->kind == JOURNAL_START) {
+        if (journal->is_started || !is_terminated_string((char const*)data, record->size)) {
+            return false;
+        }
+        journal->duplicates_dir = (char const*)data;
+        journal->is_started = true;
+        return true;
+    }
+
+    if (record->kind == JOURNAL_MOVE) {
+        struct journal_move const *move = (struct journal_move const*)data;
+        if (
+            !journal->is_started || journal->is_planned ||
+            record->size < sizeof(struct journal_move) ||
+            record->size != sizeof(struct journal_move) + (uint64_t)move->source_path_size +
+                move->file_new_name_size ||
+            move->target > JOURNAL_TARGET_NONE ||
+            (move->target == JOURNAL_TARGET_DUPLICATES && pstr_is_empty(journal->duplicates_dir))
+        ) {
+            return false;
+        }
+        char const *source_path = (char const*)(move + 1);
+        char const *file_new_name = source_path + move->source_path_size;
+        if (
+            !is_terminated_string(source_path, move->source_path_size) ||
+            !is_terminated_string(file_new_name, move->file_new_name_size) ||
+            !is_terminated_string(move->file_creation_year, sizeof(move->file_creation_year)) ||
+            !is_terminated_string(move->file_creation_month, sizeof(move->file_creation_month))
+        ) {
+            return false;
+        }
+        journal->entries[journal->n_moves] = (struct journal_entry){
+            .move = move,
+            .source_path = source_path,
+            .file_new_name = file_new_name,
+            .idx = journal->n_moves,
+        };
+        journal->n_moves++;
+        return true;
+    }
+
+    if (record->kind == JOURNAL_PLANNED) {
+        if (!journal->is_started || record->size != 0) {
+            return false;
+        }
+        journal->is_planned = true;
+        return true;
+    }
+
+    if (record->kind == JOURNAL_DONE) {
+        struct journal_done const *done = (struct journal_done const*)data;
+        if (record->size != sizeof(struct journal_done) || done->move_idx >= journal->n_moves) {
+            return false;
+        }
+        struct journal_entry *entry = &journal->entries[done->move_idx];
+        if (!entry->is_done) {
+            entry->is_done = true;
+            journal->n_done++;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+
+static void
+free_journal(struct journal *journal)
+{
+    if (journal->file_handle) {
+        fclose(journal->file_handle);
+    }
+#if !defined(_WIN32)
+    if (journal->mapping) {
+        munmap(journal->mapping, journal->mapping_size);
+    }
+#else
+    free(journal->mapping);
+#endif
+    free(journal->entries);
+    *journal = (struct journal){};
+}
+
+
+/*!
+  Loads the journal in `dest_dir` into `journal`, if there is one, and gets it ready for
+  us to add records to. If we were interrupted while writing the last record, we cut it
+  off. If we were interrupted before we'd written anything useful, we delete the journal,
+  as if there wasn't one. Returns false if there's a journal we couldn't read.
+  */
+static bool
+load_journal(struct journal *journal, char const *dest_dir)
+{
+    *journal = (struct journal){};
+    if (
+        !pstr_vcat(journal->path, MAX_PATH, dest_dir, "/", JOURNAL_FILE_NAME, NULL) ||
+        !getcwd(journal->cwd, MAX_PATH)
+    ) {
+        return false;
+    }
+
+    int const fd = open(journal->path, O_RDONLY | O_BINARY);
+    if (fd == -1) {
+        return errno == ENOENT;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t const file_size = st.st_size;
+    if (file_size < sizeof(struct journal_header)) {
+        close(fd);
+        return remove(journal->path) == 0;
+    }
+
+#if !defined(_WIN32)
+    void *mapping = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+#else
+    void *mapping = malloc(file_size);
+    if (!mapping || read(fd, mapping, file_size) != (ssize_t)file_size) {
+        free(mapping);
+        close(fd);
+        return false;
+    }
+#endif
+    close(fd);
+    journal->mapping = mapping;
+    journal->mapping_size = file_size;
+
+    struct journal_header const *header = (struct journal_header const*)mapping;
+    if (
+        memcmp(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 ||
+        header->version != JOURNAL_VERSION ||
+        header->move_size != sizeof(struct journal_move)
+    ) {
+        // This might be a plan from another version, so leave it for the user to sort out
+        return false;
+    }
+
+    // Every move takes up at least this much, so we never need more entries than this
+    size_t const max_moves = file_size /
+        (sizeof(struct journal_record) + get_journal_padded_size(sizeof(struct journal_move) + 2));
+    journal->entries = (struct journal_entry*)malloc(
+        (max_moves ? max_moves : 1) * sizeof(struct journal_entry));
+    if (!journal->entries) {
+        return false;
+    }
+
+    uint8_t const *bytes = (uint8_t const*)mapping;
+    size_t offset = sizeof(struct journal_header);
+    while (file_size - offset >= sizeof(struct journal_record)) {
+        struct journal_record const *record = (struct journal_record const*)(bytes + offset);
+        uint8_t const *data = (uint8_t const*)(record + 1);
+        size_t const data_size = get_journal_padded_size(record->size);
+        if (
+            data_size > file_size - offset - sizeof(struct journal_record) ||
+            record->checksum != get_journal_checksum(record->kind, data, record->size) ||
+            !add_loaded_journal_record(journal, record, data)
+        ) {
+            break;
+        }
+        offset += sizeof(struct journal_record) + data_size;
+    }
+
+    if (!journal->is_started) {
+        // We didn't get as far as planning anything
+        bool const could_remove = remove(journal->path) == 0;
+        free_journal(journal);
+        return could_remove;
+    }
+
+    if (offset < file_size && truncate(journal->path, offset) != 0) {
+        return false;
+    }
+
+    journal->file_handle = fopen(journal->path, "ab");
+    return journal->file_handle != NULL;
+}
+
+
+/*!
+  Gets `plan` ready for `file`, filling in its hash and embedded date if we've seen
+  this exact file before. Returns whether we did, in which case we don't need to read
+  the file at all.
+  */
+static bool
+start_file_plan(struct run const *run, tinydir_file const *file, struct file_plan *plan)
+{
+    plan->is_ok = false;
+    pstr_clear(plan->file_new_name);
+    pstr_clear(plan->embedded_date);
+    plan->hash_kind = run->hash_kind;
+    plan->is_timed = run->stats != NULL;
+    memset(plan->timings, 0, sizeof(plan->timings));
+    plan->n_bytes_read = 0;
+
+    struct cache_entry const *cache_entry = run->cache ?
+        find_in_cache(run->cache, &file->_s, run->hash_kind) : NULL;
+    plan->is_cached = cache_entry != NULL;
+
+    if (cache_entry) {
+        plan->hash = (XXH128_hash_t){
+            .low64 = cache_entry->hash_low,
+            .high64 = cache_entry->hash_high,
+        };
+        memcpy(plan->embedded_date, cache_entry->embedded_date, sizeof(plan->embedded_date));
+    }
+
+    return plan->is_cached;
+}
+
+
+/*!
+  Gets the embedded date and hash for `plan` out of a file. This is the only time we
+  read the file, and we use the same bytes for both where we can. Returns false if
+  we couldn't read as much of the file as the hash needs.
+  */
+static bool
+read_file_into_plan(struct file_view const *view, struct file_plan *plan)
+{
+    struct stopwatch stopwatch;
+
+    // Get creation date
+    start_stopwatch(&stopwatch, plan->is_timed);
+    get_embedded_date(view, plan->embedded_date, sizeof(plan->embedded_date));
+    stop_stopwatch(&stopwatch, &plan->timings[PHASE_DATE]);
+
+    // Compute the hash
+    start_stopwatch(&stopwatch, plan->is_timed);
+    bool const could_hash = get_file_hash(view, plan->hash_kind, &plan->hash);
+    stop_stopwatch(&stopwatch, &plan->timings[PHASE_HASH]);
+
+    // Anything past the hashable portion is only read if the hash needs it
+    plan->n_bytes_read = view->size;
+    if (plan->hash_kind == HASH_FULL) {
+        plan->n_bytes_read = view->file_size;
+    } else if (plan->hash_kind == HASH_SAMPLED && view->file_size > view->size) {
+        plan->n_bytes_read += HASH_SAMPLE_SIZE;
+    }
+
+    return could_hash;
+}
+
+
+/*!
+  Works out the new filename and location for `file` once `plan` has its hash and
+  embedded date. Returns whether this succeeded. If it didn't, the reason is in
+  `plan->error`.
+  */
+static bool
+finish_file_plan(tinydir_file const *file, struct file_plan *plan)
+{
+    char file_basename[MAX_PATH] = {};
+    char file_creation_date[20] = {}; // YYYY.mm.dd_HH.MM.SS0
+
+    // Get name without extension
+    assert(pstr_copy(file_basename, MAX_PATH, file->name));
+    pstr_slice_to(file_basename, pstr_len(file_basename) - pstr_len(file->extension) - 1);
+
+    // If we could get the date from the EXIF data (or video metadata), great, use it.
+    // If not, get the creation date from the filemtime.
+    if (!pstr_is_empty(plan->embedded_date)) {
+        assert(pstr_copy(file_creation_date, sizeof(file_creation_date), plan->embedded_date));
+    } else {
+        // I don't love using `localtime()` and `strftime()`, but here we are.
+        // We use `localtime_r()` because this might be running on a worker thread.
+        struct tm creation_date_tm = {};
+        localtime_r(&file->_s.st_mtime, &creation_date_tm);
+        strftime(file_creation_date, sizeof(file_creation_date),
+            "%Y.%m.%d_%H.%M.%S", &creation_date_tm);
+    }
+
+    // Set file_creation_year and file_creation_month
+    split_creation_date(file_creation_date, plan->file_creation_year,
+        plan->file_creation_month);
+
+    char hash_string[33] = {};
+    assert(format_hash(hash_string, sizeof(hash_string), plan->hash,
+        is_128_bit_hash(plan->hash_kind)));
+
+    if (
+        !pstr_vcat(plan->file_new_name, MAX_PATH,
+            file_creation_date, "_", hash_string, "_", file_basename, ".", file->extension, NULL)
+    ) {
+        snprintf(plan->error, sizeof(plan->error),
+            "error | Your file paths are too long, so we couldn't move this file.\n");
+        return false;
+    }
+
+    plan->is_ok = true;
+    return true;
+}
+
+
+/*!
+  Figures out the new filename and location for a file in the destination dir,
+  and puts it into `plan`. Returns whether this succeeded. If it didn't, the reason
+  is in `plan->error`. `file_buffer` is only used if we can't map the file, see
+  `open_file_view()`. This is called from worker threads, so it mustn't change `run`.
+  */
+static bool
+plan_file_move(
+    struct run const *run, tinydir_file const *file, char **file_buffer,
+    struct file_plan *plan
+) {
+    // If we've seen this exact file before, we don't need to read it at all
+    if (!start_file_plan(run, file, plan)) {
+        // Get the hashable portion of the file (a max of MAX_HASHABLE_SIZE bytes).
+        // tinydir has already given us the file size. If we can map the file, most of
+        // the actual reading happens while we find the date and hash it, not here.
+        size_t const file_size = file->_s.st_size;
+        struct file_view view;
+        struct stopwatch stopwatch;
+        start_stopwatch(&stopwatch, plan->is_timed);
+        bool const could_open = open_file_view(file->path, file_size, run->hash_kind, true,
+            file_buffer, &view);
+        stop_stopwatch(&stopwatch, &plan->timings[PHASE_READ]);
+        bool const could_read = could_open && read_file_into_plan(&view, plan);
+        close_file_view(&view);
+        if (!could_read) {
+            snprintf(plan->error, sizeof(plan->error),
+                "error | Could not read entire hashable portion of file %s\n", file->path);
+            return false;
+        }
+    }
+
+    return finish_file_plan(file, plan);
+}
+
+
+/*!
+  Counts a cache hit or miss for `file`, and remembers it for next time if it's staying
+  in the source dir, which it is unless `is_leaving`.
+  */
+static void
+add_file_to_cache(
+    struct run *run, tinydir_file const *file, struct file_plan const *plan,
+    bool const is_leaving
+) {
+    if (!run->cache) {
+        return;
+    }
+    if (plan->is_cached) {
+        run->cache->n_hits++;
+    } else {
+        run->cache->n_misses++;
+    }
+    if (!is_leaving && !add_to_cache(run->cache, &file->_s, plan)) {
+        printf("error | Could not add %s to the cache.\n", file->path);
+    }
+}
+
+
+/*!
+  Adds what we found out about a file while planning its move to the stats, if we're
+  keeping them.
+  */
+static void
+add_plan_to_stats(struct stats *stats, struct file_plan const *plan)
+{
+    if (!stats) {
+        return;
+    }
+    stats->n_files++;
+    for (size_t idx = 0; idx < N_PHASES; idx++) {
+        add_phase_sample(&stats->phases[idx], &plan->timings[idx]);
+    }
+    stats->n_bytes_read += plan->n_bytes_read;
+    if (plan->is_cached) {
+        stats->n_cached++;
+    }
+    if (!plan->is_ok) {
+        stats->n_errors++;
+    } else if (!pstr_is_empty(plan->embedded_date)) {
+        stats->n_embedded_dates++;
+    } else {
+        stats->n_mtime_dates++;
+    }
+}
+
+
+/*!
+  Prints what we're about to do with `file`, unless we're being quiet.
+  */
+static void
+print_file_move(
+    struct run const *run, tinydir_file const *file, struct file_plan const *plan,
+    bool const is_duplicate
+) {
+    if (run->is_quiet) {
+        return;
+    }
+
+    char const *dry_run_str = "";
+
+    if (run->is_dry_run) {
+        dry_run_str = "(dry run) ";
+    } else if (run->journal) {
+        dry_run_str = "(planned) ";
+    }
+
+    if (is_duplicate) {
+        if (run->duplicates_dir) {
+            printf("%s%s -> %s/%s (duplicate)\n",
+                dry_run_str, file->path, run->duplicates_dir->path, plan->file_new_name);
+        } else {
+            printf("%s%s is already in %s, so we're not going to do anything.\n",
+                dry_run_str, file->path, run->dest_dir);
+        }
+        return;
+    }
+
+    printf("%s%s -> %s/%s/%s/%s\n",
+        dry_run_str,
+        file->path,
+        run->dest_dir,
+        plan->file_creation_year,
+        plan->file_creation_month,
+        plan->file_new_name);
+}
+
+
+/*!
+  Remembers what happened to `file` once we've tried to move it, which took
+  `move_timing` if we're keeping stats.
+  */
+static void
+finish_file_move(
+    struct run *run, tinydir_file const *file, struct file_plan const *plan,
+    bool const is_duplicate, enum move_result const result,
+    struct timing const *move_timing
+) {
+    bool const could_move = result == MOVE_DONE;
+
+    // Even if this is a dry run, or we've only planned the move, pretend the file is
+    // there now, so that we catch duplicates within the source dir too
+    if (!is_duplicate && run->index && (could_move || run->is_dry_run || run->journal)) {
+        if (!add_to_hash_index(run->index, plan->hash)) {
+            printf("error | Could not add %s to the duplicates index.\n", file->path);
+        }
+    }
+
+    // If we've written the move down in the journal, we'll do it in a moment
+    bool const is_planned_move = run->journal && result != MOVE_FAILED &&
+        (!is_duplicate || run->duplicates_dir);
+    add_file_to_cache(run, file, plan, could_move || is_planned_move);
+
+    if (run->stats) {
+        add_phase_sample(&run->stats->phases[PHASE_MOVE], move_timing);
+        if (result == MOVE_FAILED) {
+            run->stats->n_errors++;
+        } else if (run->journal) {
+            // We count what happened to the file once we carry out the journal
+        } else if (result == MOVE_TARGET_EXISTS) {
+            run->stats->n_already_there++;
+        } else if (is_duplicate) {
+            run->stats->n_duplicates++;
+        } else {
+            // In a dry run, these are the files we would have moved
+            run->stats->n_moved++;
+        }
+    }
+}
+
+
+/*!
+  Takes a `plan` made by `plan_file_move()` and carries it out, printing what we're
+  doing along the way. If we're using a journal, we just write the plan down instead.
+  */
+static void
+commit_file_move(struct run *run, tinydir_file const *file, struct file_plan const *plan)
+{
+    add_plan_to_stats(run->stats, plan);
+    if (!plan->is_ok) {
+        printf("%s", plan->error);
+        return;
+    }
+
+    bool const is_duplicate = run->index && is_in_hash_index(run->index, plan->hash);
+    print_file_move(run, file, plan, is_duplicate);
+
+    enum move_result result = MOVE_NOT_TRIED;
+    struct timing move_timing = {};
+    struct stopwatch stopwatch;
+    start_stopwatch(&stopwatch, run->stats != NULL);
+    if (!run->is_dry_run && !run->journal) {
+        if (!is_duplicate) {
+            result = move_file_to_dest_dir(
+                file->path, &run->dest_dir_target, plan->file_new_name,
+                plan->file_creation_year, plan->file_creation_month
+            );
+        } else if (run->duplicates_dir) {
+            result = move_file_to_target_dir(file->path, run->duplicates_dir,
+                plan->file_new_name);
+        }
+    }
+    if (result != MOVE_NOT_TRIED) {
+        stop_stopwatch(&stopwatch, &move_timing);
+    }
+
+    if (run->journal) {
+        enum journal_target const target = !is_duplicate ? JOURNAL_TARGET_DEST :
+            run->duplicates_dir ? JOURNAL_TARGET_DUPLICATES : JOURNAL_TARGET_NONE;
+        if (!add_move_to_journal(run->journal, file, plan, target)) {
+            printf("error | Could not add %s to the journal.\n", file->path);
+            result = MOVE_FAILED;
+        }
+    }
+
+    finish_file_move(run, file, plan, is_duplicate, result, &move_timing);
+}
+
+
+/*!
+  Figures out the new filename and location for a file in the destination dir,
+  then puts it there.
+  */
+static void
+sort_file_into_dest_dir(struct run *run, tinydir_file const *file)
+{
+    struct file_plan plan = {};
+    plan_file_move(run, file, &run->file_buffer, &plan);
+    commit_file_move(run, file, &plan);
+}
+
+
+/*!
+  Sorts moves by where they're going, and otherwise keeps them in the order we planned
+  them, so that if two files would end up with the same name, the same one wins as
+  would have without the journal.
+  */
+static int
+compare_journal_entries(void const *a, void const *b)
+{
+    struct journal_entry const *entry_a = *(struct journal_entry const * const *)a;
+    struct journal_entry const *entry_b = *(struct journal_entry const * const *)b;
+    struct journal_move const *move_a = entry_a->move;
+    struct journal_move const *move_b = entry_b->move;
+    if (move_a->target != move_b->target) {
+        return move_a->target < move_b->target ? -1 : 1;
+    }
+    int const year_cmp = strcmp(move_a->file_creation_year, move_b->file_creation_year);
+    if (year_cmp != 0) {
+        return year_cmp;
+    }
+    int const month_cmp = strcmp(move_a->file_creation_month, move_b->file_creation_month);
+    if (month_cmp != 0) {
+        return month_cmp;
+    }
+    return entry_a->idx < entry_b->idx ? -1 : entry_a->idx > entry_b->idx;
+}
+
+
+static bool
+is_journal_move_of_file(struct journal_move const *move, struct stat const *st)
+{
+    return move->dev == (uint64_t)st->st_dev &&
+        move->ino == (uint64_t)st->st_ino &&
+        move->size == (uint64_t)st->st_size &&
+        move->mtime_sec == (int64_t)st->st_mtime &&
+        move->mtime_nsec == get_mtime_nsec(st);
+}
+
+
+/*!
+  Moves the file in `entry` to where we planned, as long as it's still the file we
+  planned to move. If we'd already moved it before we were interrupted, we return
+  MOVE_DONE and set `*was_done_before`.
+  */
+static enum move_result
+carry_out_journal_move(
+    struct target_dir *dest_dir, struct target_dir *duplicates_dir,
+    struct journal_entry const *entry, bool *was_done_before
+) {
+    struct journal_move const *move = entry->move;
+    *was_done_before = false;
+    if (move->target == JOURNAL_TARGET_NONE) {
+        return MOVE_NOT_TRIED;
+    }
+    struct target_dir *dir = move->target == JOURNAL_TARGET_DEST ? dest_dir : duplicates_dir;
+
+    struct stat st;
+    if (stat(entry->source_path, &st) != 0) {
+        // If we moved it just before we were interrupted, it's in its new home already
+        char target_path[MAX_PATH] = {};
+        bool const has_target_path = move->target == JOURNAL_TARGET_DEST ?
+            pstr_vcat(target_path, MAX_PATH, move->file_creation_year, "/",
+                move->file_creation_month, "/", entry->file_new_name, NULL) :
+            pstr_copy(target_path, MAX_PATH, entry->file_new_name);
+        if (
+            has_target_path && stat_in_target_dir(dir, target_path, &st) &&
+            is_journal_move_of_file(move, &st)
+        ) {
+            *was_done_before = true;
+            return MOVE_DONE;
+        }
+        printf("error | %s isn't there any more, so we couldn't move it.\n",
+            entry->source_path);
+        return MOVE_FAILED;
+    }
+    if (!is_journal_move_of_file(move, &st)) {
+        printf("error | %s has changed since we planned what to do with it, so we've left it where it is.\n",
+            entry->source_path);
+        return MOVE_FAILED;
+    }
+
+    if (move->target == JOURNAL_TARGET_DEST) {
+        return move_file_to_dest_dir(entry->source_path, dir, entry->file_new_name,
+            move->file_creation_year, move->file_creation_month);
+    }
+    return move_file_to_target_dir(entry->source_path, dir, entry->file_new_name);
+}
+
+
+/*!
+  Prints what we'd do with the file in `entry`, for a dry run, unless we're being quiet.
+  */
+static void
+print_journal_move(
+    struct run const *run, struct journal const *journal, struct journal_entry const *entry
+) {
+    if (run->is_quiet) {
+        return;
+    }
+
+    struct journal_move const *move = entry->move;
+    if (move->target == JOURNAL_TARGET_DUPLICATES) {
+        printf("(dry run) %s -> %s/%s (duplicate)\n",
+            entry->source_path, journal->duplicates_dir, entry->file_new_name);
+    } else if (move->target == JOURNAL_TARGET_NONE) {
+        printf("(dry run) %s is already in %s, so we're not going to do anything.\n",
+            entry->source_path, run->dest_dir);
+    } else {
+        printf("(dry run) %s -> %s/%s/%s/%s\n",
+            entry->source_path, run->dest_dir, move->file_creation_year,
+            move->file_creation_month, entry->file_new_name);
+    }
+}
+
+
+/*!
+  Carries out every move in `journal` that we haven't done yet, sorted by where the
+  files are going, so that we work through one folder at a time rather than hopping
+  between them. We write down each move once we've done it, and since the journal is
+  `fsync()`ed every `JOURNAL_N_RECORDS_PER_SYNC` records, this happens in batches. Once
+  everything's done, we delete the journal. In a dry run, we only print what's left.
+  Returns false if we had to stop because we couldn't write to the journal.
+  */
+static bool
+carry_out_journal(struct run *run, struct journal *journal)
+{
+    bool did_succeed = false;
+    struct target_dir duplicates_dir = {.fd = -1};
+    struct journal_entry **pending = NULL;
+
+    if (
+        !pstr_is_empty(journal->duplicates_dir) &&
+        !open_target_dir(&duplicates_dir, journal->duplicates_dir)
+    ) {
+        printf("error | Could not open the duplicates directory %s.\n", journal->duplicates_dir);
+        goto cleanup_return;
+    }
+
+    size_t const n_pending = journal->n_moves - journal->n_done;
+    pending = (struct journal_entry**)malloc((n_pending ? n_pending : 1) * sizeof(*pending));
+    if (!pending) {
+        printf("error | Not enough memory to carry out the plan in %s.\n", journal->path);
+        goto cleanup_return;
+    }
+    size_t idx_pending = 0;
+    for (uint64_t idx = 0; idx < journal->n_moves; idx++) {
+        if (!journal->entries[idx].is_done) {
+            pending[idx_pending++] = &journal->entries[idx];
+        }
+    }
+    if (n_pending > 0) {
+        qsort(pending, n_pending, sizeof(*pending), compare_journal_entries);
+    }
+
+    printf("%sCarrying out the plan in %s: %zu of %" PRIu64 " files left\n",
+        run->is_dry_run ? "(dry run) " : "", journal->path, n_pending, journal->n_moves);
+    if (!journal->is_planned) {
+        printf("We were interrupted before every file was planned, so run fotografiska "
+            "again afterwards to sort the rest.\n");
+    }
+
+    for (size_t idx = 0; idx < n_pending; idx++) {
+        struct journal_entry *entry = pending[idx];
+        if (run->is_dry_run) {
+            print_journal_move(run, journal, entry);
+            continue;
+        }
+
+        struct timing move_timing = {};
+        struct stopwatch stopwatch;
+        start_stopwatch(&stopwatch, run->stats != NULL);
+        bool was_done_before;
+        enum move_result const result = carry_out_journal_move(&run->dest_dir_target,
+            &duplicates_dir, entry, &was_done_before);
+        if (result != MOVE_NOT_TRIED) {
+            stop_stopwatch(&stopwatch, &move_timing);
+        }
+
+        struct journal_done const done = {.move_idx = entry->idx, .result = result};
+        if (!add_journal_record(journal, JOURNAL_DONE, &done, sizeof(done))) {
+            printf("error | Could not write down what we've done in %s, so we've stopped.\n",
+                journal->path);
+            goto cleanup_return;
+        }
+        entry->is_done = true;
+        journal->n_done++;
+
+        // If we moved the file before we were interrupted, that run moved it, not this one
+        if (run->stats && !was_done_before) {
+            add_phase_sample(&run->stats->phases[PHASE_MOVE], &move_timing);
+            if (result == MOVE_FAILED) {
+                run->stats->n_errors++;
+            } else if (result == MOVE_TARGET_EXISTS) {
+                run->stats->n_already_there++;
+            } else if (entry->move->target != JOURNAL_TARGET_DEST) {
+                run->stats->n_duplicates++;
+            } else {
+                run->stats->n_moved++;
+            }
+        }
+    }
+
+    if (run->is_dry_run) {
+        did_succeed = true;
+        goto cleanup_return;
+    }
+
+    // Everything's done, so we don't need the journal any more
+    if (!sync_journal(journal)) {
+        printf("error | Could not write down what we've done in %s.\n", journal->path);
+        goto cleanup_return;
+    }
+    fclose(journal->file_handle);
+    journal->file_handle = NULL;
+    if (remove(journal->path) != 0) {
+        printf("error | Could not delete %s, even though everything in it is done.\n",
+            journal->path);
+        goto cleanup_return;
+    }
+    printf("Carried out the plan in %s\n", journal->path);
+    did_succeed = true;
+
+cleanup_return:
+    free(pending);
+    close_target_dir(&duplicates_dir);
+    return did_succeed;
+}
+
+
+/*!
+  A file that has been handed to the worker pool, together with its plan once a
+  worker has made one.
+  */
+struct pool_slot {
+    tinydir_file file;
+    struct file_plan plan;
+    bool is_done;
+};
+
+struct worker {
+    struct worker_pool *pool;
+    pthread_t thread;
+    char *file_buffer;
+};
+
+/*!
+  A pool of threads that make file plans in parallel.
+
+  Files are submitted into a ring of `n_slots` slots, which workers claim in order.
+  Plans are always committed in submission order, on the thread that submits files,
+  so output and moves are exactly the same as they would be for a serial run. This
+  also means that we never have to worry about two threads racing to create the same
+  directory or to claim the same target filename.
+  */
+struct worker_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_has_work;
+    pthread_cond_t cond_has_result;
+    struct pool_slot *slots;
+    size_t n_slots;
+    uint64_t n_submitted;
+    uint64_t n_claimed;
+    uint64_t n_committed;
+    bool is_finishing;
+    struct worker *workers;
+    size_t n_workers;
+    struct run *run;
+};
+
+
+/*!
+  Claims submitted files and makes plans for them until the pool is finishing and
+  there is nothing left to do.
+  */
+static void *
+run_worker(void *arg)
+{
+    struct worker *worker = (struct worker*)arg;
+    struct worker_pool *pool = worker->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (pool->n_claimed == pool->n_submitted && !pool->is_finishing) {
+            pthread_cond_wait(&pool->cond_has_work, &pool->mutex);
+        }
+        if (pool->n_claimed == pool->n_submitted) {
+            break;
+        }
+        struct pool_slot *slot = &pool->slots[pool->n_claimed % pool->n_slots];
+        pool->n_claimed++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        plan_file_move(pool->run, &slot->file, &worker->file_buffer, &slot->plan);
+
+        pthread_mutex_lock(&pool->mutex);
+        slot->is_done = true;
+        pthread_cond_broadcast(&pool->cond_has_result);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+
+/*!
+  Commits finished plans in submission order, waiting for workers until at most
+  `max_in_flight` files are still uncommitted. Must be called with the pool mutex held.
+  */
+static void
+commit_finished_plans(struct worker_pool *pool, uint64_t const max_in_flight)
+{
+    while (pool->n_committed < pool->n_submitted) {
+        struct pool_slot *slot = &pool->slots[pool->n_committed % pool->n_slots];
+        if (!slot->is_done) {
+            if (pool->n_submitted - pool->n_committed <= max_in_flight) {
+                break;
+            }
+            pthread_cond_wait(&pool->cond_has_result, &pool->mutex);
+            continue;
+        }
+
+        // Nobody else touches a finished slot until we've committed it, so we don't
+        // need to hold the lock while moving the file.
+        pthread_mutex_unlock(&pool->mutex);
+        commit_file_move(pool->run, &slot->file, &slot->plan);
+        pthread_mutex_lock(&pool->mutex);
+
+        slot->is_done = false;
+        pool->n_committed++;
+    }
+}
+
+
+/*!
+  Starts `n_workers` worker threads. Returns false if we couldn't allocate what we
+  needed or couldn't start the threads.
+  */
+static bool
+init_worker_pool(struct worker_pool *pool, size_t const n_workers, struct run *run)
+{
+    *pool = (struct worker_pool){};
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond_has_work, NULL);
+    pthread_cond_init(&pool->cond_has_result, NULL);
+    pool->run = run;
+
+    // A few slots per worker is enough to keep everyone busy while we commit.
+    pool->n_slots = n_workers * 4;
+    pool->slots = (struct pool_slot*)calloc(pool->n_slots, sizeof(struct pool_slot));
+    pool->workers = (struct worker*)calloc(n_workers, sizeof(struct worker));
+    if (!pool->slots || !pool->workers) {
+        return false;
+    }
+
+    for (size_t idx = 0; idx < n_workers; idx++) {
+        struct worker *worker = &pool->workers[idx];
+        worker->pool = pool;
+        if (pthread_create(&worker->thread, NULL, run_worker, worker) != 0) {
+            return false;
+        }
+        pool->n_workers++;
+    }
+
+    return true;
+}
+
+
+/*!
+  Hands `file` to the worker pool, committing any plans that are already finished.
+  If all slots are in use, this waits until the oldest one has been committed.
+  */
+static void
+submit_to_worker_pool(struct worker_pool *pool, tinydir_file const *file)
+{
+    pthread_mutex_lock(&pool->mutex);
+    commit_finished_plans(pool, pool->n_slots - 1);
+    struct pool_slot *slot = &pool->slots[pool->n_submitted % pool->n_slots];
+    memcpy(&slot->file, file, sizeof(tinydir_file));
+    // `extension` points into `name`, so it needs to point into our copy instead
+    _tinydir_get_ext(&slot->file);
+    pool->n_submitted++;
+    pthread_cond_signal(&pool->cond_has_work);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+
+/*!
+  Waits for all submitted files to be committed, then stops the worker threads.
+  Also cleans up after an `init_worker_pool()` that failed halfway through.
+  */
+static void
+finish_worker_pool(struct worker_pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->is_finishing = true;
+    pthread_cond_broadcast(&pool->cond_has_work);
+    commit_finished_plans(pool, 0);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (size_t idx = 0; idx < pool->n_workers; idx++) {
+        pthread_join(pool->workers[idx].thread, NULL);
+        free(pool->workers[idx].file_buffer);
+    }
+
+    free(pool->workers);
+    free(pool->slots);
+    pthread_cond_destroy(&pool->cond_has_result);
+    pthread_cond_destroy(&pool->cond_has_work);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+
+#if defined(CAN_USE_IO_URING)
+/*!
+  How far along a file in the io_uring engine is. Files we find in the cache skip
+  straight to being planned.
+  */
+enum uring_stage {
+    URING_STAGE_OPENING,
+    URING_STAGE_READING,
+    URING_STAGE_PLANNED,
+    URING_STAGE_RENAMING,
+    URING_STAGE_RENAMED,
+};
+
+/*!
+  A file that has been handed to the io_uring engine. While it's being read, it has
+  its own buffer for the hashable portion, which we free as soon as we've hashed it.
+  */
+struct uring_slot {
+    tinydir_file file;
+    struct file_plan plan;
+    enum uring_stage stage;
+    // Whether we've queued a request for this slot that hasn't completed yet
+    bool is_in_flight;
+    int fd;
+    uint8_t *buffer;
+    size_t size;
+    size_t n_read;
+    // Where we're renaming the file to, once it's in a batch
+    bool is_duplicate;
+    struct target_dir *target_dir;
+    char target_path[MAX_PATH];
+    int rename_result;
+    // Only used if we're keeping stats. The kernel reads and renames files for us,
+    // so all we can time is how long we waited.
+    uint64_t read_start_ns;
+    uint64_t rename_start_ns;
+    struct timing rename_timing;
+};
+
+/*!
+  Reads and moves lots of files at once using io_uring, so that the disk always has
+  plenty of work queued up, rather than one request at a time.
+
+  Files are submitted into a ring of `URING_N_SLOTS` slots. Each one is opened and its
+  hashable portion read with io_uring, and it's hashed and planned as soon as that read
+  completes. Like with the worker pool, plans are then committed in submission order,
+  so output and moves are exactly the same as they would be otherwise.
+
+  Renames are batched too. We queue renames for as many planned files in a row as we
+  can, and only commit them (print them and remember what happened) once they've
+  completed. A file can only go in a batch if it doesn't matter how the renames before
+  it turn out, see `can_batch_rename()`. If it can't, we wait for the batch to finish
+  and commit it the usual way.
+
+  We talk to the kernel with plain system calls, so we don't need liburing.
+  */
+struct uring_engine {
+    int ring_fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+    // Requests we've queued but not told the kernel about yet
+    uint32_t n_unsubmitted;
+    // Requests we've queued that haven't completed yet, including unsubmitted ones
+    uint32_t n_in_flight;
+    struct uring_slot *slots;
+    uint64_t n_submitted;
+    uint64_t n_batched;
+    uint64_t n_committed;
+    size_t n_bytes_in_flight;
+    struct run *run;
+};
+
+
+/*!
+  Returns whether the kernel behind `ring_fd` knows how to open, read and rename
+  files. io_uring has been around for longer than it could do all of these.
+  */
+static bool
+can_uring_handle_files(int const ring_fd)
+{
+    uint8_t const ops[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_RENAMEAT};
+    size_t const probe_size = sizeof(struct io_uring_probe) +
+        IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe*)calloc(1, probe_size);
+    if (!probe) {
+        return false;
+    }
+
+    bool can_handle_files = syscall(__NR_io_uring_register, ring_fd,
+        IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for (size_t idx = 0; can_handle_files && idx < sizeof(ops); idx++) {
+        can_handle_files = ops[idx] <= probe->last_op &&
+            (probe->ops[ops[idx]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return can_handle_files;
+}
+
+
+/*!
+  Sets up an io_uring and maps its queues. Returns false if the kernel doesn't support
+  io_uring, or everything we need from it, in which case `engine` should still be
+  freed with `free_uring_engine()`.
+  */
+static bool
+init_uring_engine(struct uring_engine *engine, struct run *run)
+{
+    *engine = (struct uring_engine){.ring_fd = -1, .run = run};
+
+    struct io_uring_params params = {};
+    int const ring_fd = (int)syscall(__NR_io_uring_setup, URING_N_SLOTS, &params);
+    if (ring_fd < 0) {
+        return false;
+    }
+    engine->ring_fd = ring_fd;
+
+    if (!can_uring_handle_files(ring_fd)) {
+        return false;
+    }
+
+    engine->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    engine->cq_ring_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    // Newer kernels let us map both rings in one go
+    bool const is_single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (is_single_mmap && engine->cq_ring_size > engine->sq_ring_size) {
+        engine->sq_ring_size = engine->cq_ring_size;
+    }
+
+    void *sq_ring = mmap(NULL, engine->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        return false;
+    }
+    engine->sq_ring = sq_ring;
+
+    if (is_single_mmap) {
+        engine->cq_ring = sq_ring;
+        engine->cq_ring_size = engine->sq_ring_size;
+    } else {
+        void *cq_ring = mmap(NULL, engine->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            return false;
+        }
+        engine->cq_ring = cq_ring;
+    }
+
+    engine->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, engine->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    engine->sqes = (struct io_uring_sqe*)sqes;
+
+    uint8_t *sq_ring_bytes = (uint8_t*)engine->sq_ring;
+    uint8_t *cq_ring_bytes = (uint8_t*)engine->cq_ring;
+    engine->sq_tail = (uint32_t*)(sq_ring_bytes + params.sq_off.tail);
+    engine->sq_mask = *(uint32_t*)(sq_ring_bytes + params.sq_off.ring_mask);
+    engine->cq_head = (uint32_t*)(cq_ring_bytes + params.cq_off.head);
+    engine->cq_tail = (uint32_t*)(cq_ring_bytes + params.cq_off.tail);
+    engine->cq_mask = *(uint32_t*)(cq_ring_bytes + params.cq_off.ring_mask);
+    engine->cqes = (struct io_uring_cqe*)(cq_ring_bytes + params.cq_off.cqes);
+
+    // We always fill in submission queue entries in order, so each place in the
+    // submission queue can just point to the entry with the same index
+    uint32_t *sq_array = (uint32_t*)(sq_ring_bytes + params.sq_off.array);
+    for (uint32_t idx = 0; idx < params.sq_entries; idx++) {
+        sq_array[idx] = idx;
+    }
+
+    engine->slots = (struct uring_slot*)calloc(URING_N_SLOTS, sizeof(struct uring_slot));
+    if (!engine->slots) {
+        return false;
+    }
+
+    return true;
+}
+
+
+/*!
+  Unmaps and closes everything `init_uring_engine()` set up, even if it failed halfway
+  through.
+  */
+static void
+free_uring_engine(struct uring_engine *engine)
+{
+    if (engine->sqes) {
+        munmap(engine->sqes, engine->sqes_size);
+    }
+    if (engine->cq_ring && engine->cq_ring != engine->sq_ring) {
+        munmap(engine->cq_ring, engine->cq_ring_size);
+    }
+    if (engine->sq_ring) {
+        munmap(engine->sq_ring, engine->sq_ring_size);
+    }
+    if (engine->ring_fd != -1) {
+        close(engine->ring_fd);
+    }
+    free(engine->slots);
+    *engine = (struct uring_engine){.ring_fd = -1};
+}
+
+
+/*!
+  Adds `sqe` to the submission queue. The kernel only finds out about it the next
+  time we call `enter_uring()`. We never have more requests in flight than there are
+  slots, and each slot has at most one, so this always fits.
+  */
+static void
+queue_uring_sqe(struct uring_engine *engine, struct io_uring_sqe const *sqe)
+{
+    assert(engine->n_in_flight < URING_N_SLOTS);
+    uint32_t const sq_tail = *engine->sq_tail;
+    engine->sqes[sq_tail & engine->sq_mask] = *sqe;
+    __atomic_store_n(engine->sq_tail, sq_tail + 1, __ATOMIC_RELEASE);
+    engine->n_unsubmitted++;
+    engine->n_in_flight++;
+    ((struct uring_slot*)(uintptr_t)sqe->user_data)->is_in_flight = true;
+}
+
+
+/*!
+  Hands everything we've queued to the kernel, then waits until at least
+  `min_complete` requests have completed. Returns false if io_uring stopped working,
+  in which case we should `fall_back_from_uring()`.
+  */
+static bool
+enter_uring(struct uring_engine *engine, uint32_t const min_complete)
+{
+    for (;;) {
+        int const n_submitted = (int)syscall(__NR_io_uring_enter, engine->ring_fd,
+            engine->n_unsubmitted, min_complete,
+            min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n_submitted >= 0) {
+            engine->n_unsubmitted -= n_submitted;
+            if (engine->n_unsubmitted == 0) {
+                return true;
+            }
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return false;
+        }
+    }
+}
+
+
+/*!
+  Closes `slot`'s file and frees its buffer once we're done reading it.
+  */
+static void
+release_uring_read(struct uring_engine *engine, struct uring_slot *slot)
+{
+    if (slot->fd != -1) {
+        close(slot->fd);
+        slot->fd = -1;
+    }
+    free(slot->buffer);
+    slot->buffer = NULL;
+    engine->n_bytes_in_flight -= slot->size;
+    slot->size = 0;
+}
+
+
+static void
+time_uring_request(struct uring_slot const *slot, uint64_t const start_ns, struct timing *timing)
+{
+    if (slot->plan.is_timed) {
+        *timing = (struct timing){
+            .is_set = true,
+            .wall_ns = get_time_ns(CLOCK_MONOTONIC) - start_ns,
+        };
+    }
+}
+
+
+static void
+fail_uring_read(struct uring_engine *engine, struct uring_slot *slot)
+{
+    time_uring_request(slot, slot->read_start_ns, &slot->plan.timings[PHASE_READ]);
+    snprintf(slot->plan.error, sizeof(slot->plan.error),
+        "error | Could not read entire hashable portion of file %s\n", slot->file.path);
+    release_uring_read(engine, slot);
+    slot->stage = URING_STAGE_PLANNED;
+}
+
+
+/*!
+  Queues a read for whatever is left of the hashable portion of `slot`'s file, or, if
+  we've read all of it, hashes it and plans its move.
+  */
+static void
+continue_uring_read(struct uring_engine *engine, struct uring_slot *slot)
+{
+    if (slot->n_read < slot->size) {
+        struct io_uring_sqe const sqe = {
+            .opcode = IORING_OP_READ,
+            .fd = slot->fd,
+            .off = slot->n_read,
+            .addr = (uint64_t)(uintptr_t)(slot->buffer + slot->n_read),
+            .len = (uint32_t)(slot->size - slot->n_read),
+            .user_data = (uint64_t)(uintptr_t)slot,
+        };
+        slot->stage = URING_STAGE_READING;
+        queue_uring_sqe(engine, &sqe);
+        return;
+    }
+
+    time_uring_request(slot, slot->read_start_ns, &slot->plan.timings[PHASE_READ]);
+
+    // Anything the hash needs past the hashable portion is read the usual way
+    struct file_view const view = {
+        .data = slot->buffer ? slot->buffer : (uint8_t const*)"",
+        .size = slot->size,
+        .fd = slot->fd,
+        .file_size = (size_t)slot->file._s.st_size,
+    };
+    if (!read_file_into_plan(&view, &slot->plan)) {
+        fail_uring_read(engine, slot);
+        return;
+    }
+    finish_file_plan(&slot->file, &slot->plan);
+    release_uring_read(engine, slot);
+    slot->stage = URING_STAGE_PLANNED;
+}
+
+
+/*!
+  Starts working on the file in `slot`. If it's in the cache, we can plan it straight
+  away. If not, we queue a request to open it.
+  */
+static void
+start_uring_slot(struct uring_engine *engine, struct uring_slot *slot)
+{
+    slot->fd = -1;
+    slot->buffer = NULL;
+    slot->size = 0;
+    slot->n_read = 0;
+
+    if (start_file_plan(engine->run, &slot->file, &slot->plan)) {
+        finish_file_plan(&slot->file, &slot->plan);
+        slot->stage = URING_STAGE_PLANNED;
+        return;
+    }
+
+    if (slot->plan.is_timed) {
+        slot->read_start_ns = get_time_ns(CLOCK_MONOTONIC);
+    }
+    slot->size = get_hashable_size(engine->run->hash_kind, (size_t)slot->file._s.st_size);
+    engine->n_bytes_in_flight += slot->size;
+    if (slot->size > 0) {
+        slot->buffer = (uint8_t*)malloc(slot->size);
+        if (!slot->buffer) {
+            fail_uring_read(engine, slot);
+            return;
+        }
+    }
+
+    struct io_uring_sqe const sqe = {
+        .opcode = IORING_OP_OPENAT,
+        .fd = AT_FDCWD,
+        .addr = (uint64_t)(uintptr_t)slot->file.path,
+        .open_flags = O_RDONLY | O_BINARY,
+        .user_data = (uint64_t)(uintptr_t)slot,
+    };
+    slot->stage = URING_STAGE_OPENING;
+    queue_uring_sqe(engine, &sqe);
+}
+
+
+/*!
+  Carries on with `slot` now that its latest request has completed with `result`,
+  which is a negative `errno` if it failed.
+  */
+static void
+handle_uring_completion(struct uring_engine *engine, struct uring_slot *slot, int const result)
+{
+    if (slot->stage == URING_STAGE_OPENING) {
+        if (result < 0) {
+            fail_uring_read(engine, slot);
+            return;
+        }
+        slot->fd = result;
+        continue_uring_read(engine, slot);
+    } else if (slot->stage == URING_STAGE_READING) {
+        // If the file got shorter since we found it, we'll read 0 bytes
+        if (result <= 0) {
+            fail_uring_read(engine, slot);
+            return;
+        }
+        slot->n_read += result;
+        continue_uring_read(engine, slot);
+    } else if (slot->stage == URING_STAGE_RENAMING) {
+        time_uring_request(slot, slot->rename_start_ns, &slot->rename_timing);
+        slot->rename_result = result;
+        slot->stage = URING_STAGE_RENAMED;
+    } else {
+        assert(false);
+    }
+}
+
+
+/*!
+  Handles every request that has completed so far, without waiting for any more.
+  */
+static void
+reap_uring_completions(struct uring_engine *engine)
+{
+    uint32_t cq_head = *engine->cq_head;
+    uint32_t const cq_tail = __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE);
+    while (cq_head != cq_tail) {
+        struct io_uring_cqe const *cqe = &engine->cqes[cq_head & engine->cq_mask];
+        struct uring_slot *slot = (struct uring_slot*)(uintptr_t)cqe->user_data;
+        int const result = cqe->res;
+        cq_head++;
+        __atomic_store_n(engine->cq_head, cq_head, __ATOMIC_RELEASE);
+        engine->n_in_flight--;
+        slot->is_in_flight = false;
+        handle_uring_completion(engine, slot, result);
+    }
+}
+
+
+/*!
+  Returns whether `slot`'s file can be renamed in the same batch as the renames we're
+  already waiting on, and if so, works out where it's going. That's only the case if it
+  doesn't matter how those renames turn out:
+
+  * Files with the same contents could end up with the same name, or one could turn
+    out to be a duplicate of another, so they go in separate batches.
+  * We create directories the usual way, so that we print that we're creating them
+    in the right place.
+  * Anything that's not a rename (errors, dry runs, moves we're only writing down in
+    the journal, duplicates we leave alone) has to be printed in order, after the batch.
+  */
+static bool
+can_batch_rename(struct uring_engine const *engine, struct uring_slot *slot)
+{
+    struct run *run = engine->run;
+    struct file_plan const *plan = &slot->plan;
+
+    if (run->is_dry_run || run->journal || !plan->is_ok) {
+        return false;
+    }
+
+    for (uint64_t idx = engine->n_committed; idx < engine->n_batched; idx++) {
+        if (XXH128_isEqual(engine->slots[idx % URING_N_SLOTS].plan.hash, plan->hash)) {
+            return false;
+        }
+    }
+
+    slot->is_duplicate = run->index && is_in_hash_index(run->index, plan->hash);
+    if (slot->is_duplicate) {
+        slot->target_dir = run->duplicates_dir;
+        return run->duplicates_dir &&
+            pstr_copy(slot->target_path, MAX_PATH, plan->file_new_name);
+    }
+
+    char month_directory[8] = {};
+    assert(pstr_vcat(month_directory, sizeof(month_directory),
+        plan->file_creation_year, "/", plan->file_creation_month, NULL));
+    slot->target_dir = &run->dest_dir_target;
+    pstr_clear(slot->target_path);
+    return is_known_subdir(&run->dest_dir_target, plan->file_creation_year) &&
+        is_known_subdir(&run->dest_dir_target, month_directory) &&
+        pstr_vcat(slot->target_path, MAX_PATH, month_directory, "/", plan->file_new_name, NULL);
+}
+
+
+static void
+queue_uring_rename(struct uring_engine *engine, struct uring_slot *slot)
+{
+    struct io_uring_sqe const sqe = {
+        .opcode = IORING_OP_RENAMEAT,
+        .fd = AT_FDCWD,
+        .addr = (uint64_t)(uintptr_t)slot->file.path,
+        .len = (uint32_t)slot->target_dir->fd,
+        .addr2 = (uint64_t)(uintptr_t)slot->target_path,
+        .rename_flags = RENAME_NOREPLACE,
+        .user_data = (uint64_t)(uintptr_t)slot,
+    };
+    slot->rename_timing = (struct timing){};
+    if (slot->plan.is_timed) {
+        slot->rename_start_ns = get_time_ns(CLOCK_MONOTONIC);
+    }
+    slot->stage = URING_STAGE_RENAMING;
+    queue_uring_sqe(engine, &sqe);
+}
+
+
+/*!
+  Prints and remembers what happened to a file we renamed in a batch, just like
+  `commit_file_move()` would have.
+  */
+static void
+commit_uring_rename(struct uring_engine *engine, struct uring_slot *slot)
+{
+    add_plan_to_stats(engine->run->stats, &slot->plan);
+    print_file_move(engine->run, &slot->file, &slot->plan, slot->is_duplicate);
+
+    enum move_result result = MOVE_DONE;
+    if (slot->rename_result == -EINVAL || slot->rename_result == -ENOSYS) {
+        // Some filesystems don't support RENAME_NOREPLACE, so try the old way
+        result = move_file_to_target_dir(slot->file.path, slot->target_dir,
+            slot->target_path);
+    } else if (slot->rename_result != 0) {
+        result = print_move_error(slot->target_dir, slot->target_path, -slot->rename_result);
+    }
+
+    finish_file_move(engine->run, &slot->file, &slot->plan, slot->is_duplicate, result,
+        &slot->rename_timing);
+}
+
+
+/*!
+  Commits finished renames, then batches up renames for planned files, for as long as
+  we can without waiting for anything.
+  */
+static void
+commit_uring_slots(struct uring_engine *engine)
+{
+    for (;;) {
+        while (engine->n_committed < engine->n_batched) {
+            struct uring_slot *slot = &engine->slots[engine->n_committed % URING_N_SLOTS];
+            if (slot->stage != URING_STAGE_RENAMED) {
+                break;
+            }
+            commit_uring_rename(engine, slot);
+            engine->n_committed++;
+        }
+
+        if (engine->n_batched == engine->n_submitted) {
+            return;
+        }
+        struct uring_slot *slot = &engine->slots[engine->n_batched % URING_N_SLOTS];
+        if (slot->stage != URING_STAGE_PLANNED) {
+            return;
+        }
+
+        if (can_batch_rename(engine, slot)) {
+            queue_uring_rename(engine, slot);
+            engine->n_batched++;
+        } else if (engine->n_committed == engine->n_batched) {
+            commit_file_move(engine->run, &slot->file, &slot->plan);
+            engine->n_batched++;
+            engine->n_committed++;
+        } else {
+            // We have to wait for the current batch to finish
+            return;
+        }
+    }
+}
+
+
+/*!
+  Waits for at least one request to complete, then carries on with everything that
+  has. There's always a request in flight when we're waiting for something, because
+  the oldest uncommitted file is always being read or renamed. Returns false if
+  io_uring stopped working.
+  */
+static bool
+wait_for_uring(struct uring_engine *engine)
+{
+    assert(engine->n_in_flight > 0);
+    if (!enter_uring(engine, 1)) {
+        return false;
+    }
+    reap_uring_completions(engine);
+    commit_uring_slots(engine);
+    return true;
+}
+
+
+/*!
+  Works out whether a rename we queued for `slot` happened before io_uring stopped
+  working. If the file isn't where it was, and is where we were moving it, it did.
+  Otherwise, we'll try the rename again the usual way.
+  */
+static void
+settle_unfinished_uring_rename(struct uring_slot *slot)
+{
+    struct stat st;
+    bool const has_moved = stat(slot->file.path, &st) != 0 &&
+        fstatat(slot->target_dir->fd, slot->target_path, &st, 0) == 0 &&
+        st.st_dev == slot->file._s.st_dev && st.st_ino == slot->file._s.st_ino;
+    slot->rename_result = has_moved ? 0 : -ENOSYS;
+    slot->stage = URING_STAGE_RENAMED;
+}
+
+
+/*!
+  If io_uring stops working partway through, we carry on without it. We note what
+  happened to any requests that completed, without starting anything new, then
+  commit every file we've been handed, in order. Files we'd planned, or renamed,
+  are committed as usual, and files we were still reading are handled the usual
+  way. After this, `engine` is freed, and the run goes on without it.
+
+  The kernel might still be reading into the buffers of files we hadn't finished
+  reading, so we leave those alone rather than freeing them.
+  */
+static void
+fall_back_from_uring(struct uring_engine *engine)
+{
+    struct run *run = engine->run;
+    printf("error | io_uring stopped working, so we'll carry on the usual way.\n");
+
+    uint32_t cq_head = *engine->cq_head;
+    uint32_t const cq_tail = __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE);
+    while (cq_head != cq_tail) {
+        struct io_uring_cqe const *cqe = &engine->cqes[cq_head & engine->cq_mask];
+        struct uring_slot *slot = (struct uring_slot*)(uintptr_t)cqe->user_data;
+        cq_head++;
+        slot->is_in_flight = false;
+        if (slot->stage == URING_STAGE_RENAMING) {
+            handle_uring_completion(engine, slot, cqe->res);
+        } else if (slot->stage == URING_STAGE_OPENING && cqe->res >= 0) {
+            close(cqe->res);
+        }
+    }
+    __atomic_store_n(engine->cq_head, cq_head, __ATOMIC_RELEASE);
+
+    for (uint64_t idx = engine->n_committed; idx < engine->n_submitted; idx++) {
+        struct uring_slot *slot = &engine->slots[idx % URING_N_SLOTS];
+        if (idx < engine->n_batched) {
+            if (slot->stage == URING_STAGE_RENAMING) {
+                settle_unfinished_uring_rename(slot);
+            }
+            commit_uring_rename(engine, slot);
+        } else if (slot->stage == URING_STAGE_PLANNED) {
+            commit_file_move(run, &slot->file, &slot->plan);
+        } else {
+            if (slot->is_in_flight) {
+                slot->buffer = NULL;
+            }
+            release_uring_read(engine, slot);
+            sort_file_into_dest_dir(run, &slot->file);
+        }
+    }
+    engine->n_committed = engine->n_submitted;
+
+    free_uring_engine(engine);
+    run->uring = NULL;
+}
+
+
+/*!
+  Hands `file` to the io_uring engine. If all slots are in use, or we've already read
+  as much as we want to keep in memory, this waits until there's room.
+  */
+static void
+submit_to_uring_engine(struct uring_engine *engine, tinydir_file const *file)
+{
+    size_t const size = get_hashable_size(engine->run->hash_kind, (size_t)file->_s.st_size);
+
+    reap_uring_completions(engine);
+    commit_uring_slots(engine);
+    while (
+        engine->n_submitted - engine->n_committed == URING_N_SLOTS ||
+        (
+            engine->n_bytes_in_flight > 0 &&
+            engine->n_bytes_in_flight + size > URING_MAX_BYTES_IN_FLIGHT
+        )
+    ) {
+        if (!wait_for_uring(engine)) {
+            struct run *run = engine->run;
+            fall_back_from_uring(engine);
+            sort_file_into_dest_dir(run, file);
+            return;
+        }
+    }
+
+    struct uring_slot *slot = &engine->slots[engine->n_submitted % URING_N_SLOTS];
+    memcpy(&slot->file, file, sizeof(tinydir_file));
+    // `extension` points into `name`, so it needs to point into our copy instead
+    _tinydir_get_ext(&slot->file);
+    engine->n_submitted++;
+    start_uring_slot(engine, slot);
+
+    // Hand requests to the kernel a few at a time, so that we don't need a system
+    // call for every one
+    if (engine->n_unsubmitted >= URING_N_SLOTS / 8 && !enter_uring(engine, 0)) {
+        fall_back_from_uring(engine);
+        return;
+    }
+    commit_uring_slots(engine);
+}
+
+
+/*!
+  Waits for all submitted files to be committed, then frees the engine.
+  */
+static void
+finish_uring_engine(struct uring_engine *engine)
+{
+    commit_uring_slots(engine);
+    while (engine->n_committed < engine->n_submitted) {
+        if (!wait_for_uring(engine)) {
+            fall_back_from_uring(engine);
+            return;
+        }
+    }
+    free_uring_engine(engine);
+}
+#endif
+
+
+/*!
+  tinydir uses `lstat()` when it can, but we've always treated symlinks like the
+  files they point to, so look through them. Returns false if `file` is a symlink to
+  something that isn't there.
+  */
+static bool
+follow_symlink(tinydir_file *file)
+{
+#if defined(S_ISLNK)
+    if (S_ISLNK(file->_s.st_mode)) {
+        if (stat(file->path, &file->_s) != 0) {
+            return false;
+        }
+        file->is_dir = S_ISDIR(file->_s.st_mode);
+        file->is_reg = S_ISREG(file->_s.st_mode);
+    }
+#endif
+    return true;
+}
+
+
+/*!
+  A folder we're reading files from, as given with `--src-dir`.
+  */
+struct src_dir {
+    char const *path;
+    size_t n_files;
+    bool could_scan;
+};
+
+
+/*!
+  Puts a file we've found in one of the src dirs in the right place, or hands it to
+  the io_uring engine or worker pool to do so.
+  */
+static void
+handle_file(struct run *run, struct src_dir *src_dir, tinydir_file *file)
+{
+    src_dir->n_files++;
+#if defined(CAN_USE_IO_URING)
+    if (run->uring) {
+        submit_to_uring_engine(run->uring, file);
+        return;
+    }
+#endif
+    if (run->pool) {
+        submit_to_worker_pool(run->pool, file);
+    } else {
+        sort_file_into_dest_dir(run, file);
+    }
+}
+
+
+static XXH128_hash_t
+get_dir_id(struct stat const *st)
+{
+    return (XXH128_hash_t){.low64 = (uint64_t)st->st_ino, .high64 = (uint64_t)st->st_dev};
+}
+
+
+/*!
+  Remembers that we've been in the folder with stat info `st`, and returns whether we
+  hadn't been there before, so that symlink loops and src dirs inside other src dirs
+  don't make us read a folder twice. Folders are told apart by their device and inode,
+  which together fit in the 128-bit keys of a `struct hash_index`.
+  */
+static bool
+mark_dir_visited(struct hash_index *visited_dirs, struct stat const *st)
+{
+    XXH128_hash_t const dir_id = get_dir_id(st);
+    if (is_in_hash_index(visited_dirs, dir_id)) {
+        return false;
+    }
+    if (!add_to_hash_index(visited_dirs, dir_id)) {
+        // If we can't remember it, we can't tell if we're going round in circles
+        printf("error | Not enough memory to keep track of the folders we've read.\n");
+        return false;
+    }
+    return true;
+}
+
+
+/*!
+  Puts the dest dir and duplicates dir in `target_dirs`, and marks them as visited in
+  `visited_dirs`, before we start reading anything. When they're inside a src dir, this
+  stops a recursive scan from going into them and sorting files we've already sorted.
+  A src dir that is the dest dir or duplicates dir is still read, but only the files
+  directly in it, since its subfolders are where sorted files go.
+  */
+static bool
+mark_target_dirs_visited(
+    struct hash_index *target_dirs, struct hash_index *visited_dirs, struct run const *run
+) {
+    char const *paths[] = {
+        run->dest_dir,
+        run->duplicates_dir ? run->duplicates_dir->path : NULL,
+    };
+    for (size_t idx = 0; idx < sizeof(paths) / sizeof(paths[0]); idx++) {
+        struct stat st;
+        if (!paths[idx] || stat(paths[idx], &st) != 0) {
+            continue;
+        }
+        if (!add_to_hash_index(target_dirs, get_dir_id(&st))) {
+            return false;
+        }
+        mark_dir_visited(visited_dirs, &st);
+    }
+    return true;
+}
+
+
+/*!
+  A file one of the scanners has found, waiting to be handled on the main thread.
+  */
+struct scanned_file {
+    tinydir_file file;
+    struct src_dir *src_dir;
+};
+
+struct scanner {
+    struct scan *scan;
+    struct src_dir *src_dir;
+    pthread_t thread;
+    bool is_running;
+    // Only used if we're keeping stats, and added to them once we've finished
+    struct phase_stats scan_stats;
+    uint64_t n_errors;
+};
+
+/*!
+  Reads the src dirs in parallel, with one thread for each, since they're usually on
+  different devices. Each thread goes through its src dir depth first, and puts every
+  file it finds into one shared queue, which the main thread takes them out of. When
+  the queue is full, the threads wait, so we never have more than `n_slots` files in
+  memory at once, no matter how many there are. The only other thing that grows is the
+  list of folders we still have to read, and of those we've read already.
+  */
+struct scan {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_has_file;
+    pthread_cond_t cond_has_room;
+    struct scanned_file *queue;
+    size_t n_slots;
+    uint64_t n_pushed;
+    uint64_t n_popped;
+    size_t n_scanners_running;
+    bool is_recursive;
+    struct hash_index visited_dirs;
+    // The dest dir and duplicates dir, which is only changed before the scanners start
+    struct hash_index target_dirs;
+    struct scanner *scanners;
+    size_t n_scanners;
+    // NULL if we're not keeping stats
+    struct stats *stats;
+};
+
+
+/*!
+  Waits until there's room in the queue, then adds `file` to it.
+  */
+static void
+push_scanned_file(struct scan *scan, struct src_dir *src_dir, tinydir_file const *file)
+{
+    pthread_mutex_lock(&scan->mutex);
+    while (scan->n_pushed - scan->n_popped == scan->n_slots) {
+        pthread_cond_wait(&scan->cond_has_room, &scan->mutex);
+    }
+    struct scanned_file *scanned_file = &scan->queue[scan->n_pushed % scan->n_slots];
+    memcpy(&scanned_file->file, file, sizeof(tinydir_file));
+    scanned_file->src_dir = src_dir;
+    scan->n_pushed++;
+    pthread_cond_signal(&scan->cond_has_file);
+    pthread_mutex_unlock(&scan->mutex);
+}
+
+
+/*!
+  Takes the oldest file out of the queue and puts it into `scanned_file`, waiting for
+  one if the scanners are still going. Returns false once they've finished and the
+  queue is empty.
+  */
+static bool
+pop_scanned_file(struct scan *scan, struct scanned_file *scanned_file)
+{
+    pthread_mutex_lock(&scan->mutex);
+    while (scan->n_popped == scan->n_pushed && scan->n_scanners_running > 0) {
+        pthread_cond_wait(&scan->cond_has_file, &scan->mutex);
+    }
+    bool const has_file = scan->n_popped < scan->n_pushed;
+    if (has_file) {
+        memcpy(scanned_file, &scan->queue[scan->n_popped % scan->n_slots],
+            sizeof(struct scanned_file));
+        // `extension` points into `name`, so it needs to point into our copy instead
+        _tinydir_get_ext(&scanned_file->file);
+        scan->n_popped++;
+        pthread_cond_signal(&scan->cond_has_room);
+    }
+    pthread_mutex_unlock(&scan->mutex);
+    return has_file;
+}
+
+
+/*!
+  Folders a scanner still has to read. We take the last one out first, so that we
+  go through the src dir depth first, and this only holds the subfolders of the
+  folders we're currently inside.
+  */
+struct dir_stack {
+    char **paths;
+    size_t n_paths;
+    size_t cap;
+};
+
+
+static bool
+push_dir(struct dir_stack *stack, char const *path)
+{
+    if (stack->n_paths == stack->cap) {
+        size_t const new_cap = stack->cap ? stack->cap * 2 : 64;
+        char **new_paths = (char**)realloc(stack->paths, new_cap * sizeof(char*));
+        if (!new_paths) {
+            return false;
+        }
+        stack->paths = new_paths;
+        stack->cap = new_cap;
+    }
+    size_t const path_size = pstr_len(path) + 1;
+    char *path_copy = (char*)malloc(path_size);
+    if (!path_copy) {
+        return false;
+    }
+    memcpy(path_copy, path, path_size);
+    stack->paths[stack->n_paths++] = path_copy;
+    return true;
+}
+
+
+/*!
+  Goes through every file in one folder of a scanner's src dir, in whatever order the
+  filesystem gives them to us, and queues them up. If we're scanning recursively,
+  subfolders go on `stack`, unless it's NULL. Hidden files and folders are skipped.
+  If we're keeping stats, we time the whole folder, apart from waiting for room in
+  the queue.
+  */
+static bool
+scan_dir(struct scanner *scanner, char const *path, struct dir_stack *stack)
+{
+    struct scan *scan = scanner->scan;
+    struct timing timing = {};
+    struct stopwatch stopwatch;
+    start_stopwatch(&stopwatch, scan->stats != NULL);
+
+    tinydir_dir dir;
+    if (tinydir_open(&dir, path) == -1) {
+        return false;
+    }
+
+    while (dir.has_next) {
+        tinydir_file file;
+        if (tinydir_readfile(&dir, &file) != 0) {
+            printf("error | Could not read a file in %s\n", path);
+            scanner->n_errors++;
+        } else if (file.name[0] != '.') {
+            if (!follow_symlink(&file)) {
+                printf("error | Could not open file %s\n", file.path);
+                scanner->n_errors++;
+            } else if (!file.is_dir) {
+                stop_stopwatch(&stopwatch, &timing);
+                push_scanned_file(scan, scanner->src_dir, &file);
+                start_stopwatch(&stopwatch, stopwatch.is_on);
+            } else if (scan->is_recursive && stack) {
+                pthread_mutex_lock(&scan->mutex);
+                bool const is_new_dir = mark_dir_visited(&scan->visited_dirs, &file._s);
+                pthread_mutex_unlock(&scan->mutex);
+                if (is_new_dir && !push_dir(stack, file.path)) {
+                    printf("error | Not enough memory to read the folder %s\n", file.path);
+                    scanner->n_errors++;
+                }
+            }
+        }
+        tinydir_next(&dir);
+    }
+
+    tinydir_close(&dir);
+    stop_stopwatch(&stopwatch, &timing);
+    add_phase_sample(&scanner->scan_stats, &timing);
+    return true;
+}
+
+
+/*!
+  Reads a scanner's src dir, and its subfolders if we're scanning recursively.
+  */
+static void *
+run_scanner(void *arg)
+{
+    struct scanner *scanner = (struct scanner*)arg;
+    struct scan *scan = scanner->scan;
+    struct src_dir *src_dir = scanner->src_dir;
+    struct dir_stack stack = {};
+
+    struct stat st;
+    if (stat(src_dir->path, &st) == 0) {
+        bool const is_target_dir = is_in_hash_index(&scan->target_dirs, get_dir_id(&st));
+        pthread_mutex_lock(&scan->mutex);
+        bool const is_new_dir = mark_dir_visited(&scan->visited_dirs, &st) || is_target_dir;
+        pthread_mutex_unlock(&scan->mutex);
+        // If this src dir is inside another one, we've read it already, or will soon
+        src_dir->could_scan = !is_new_dir ||
+            scan_dir(scanner, src_dir->path, is_target_dir ? NULL : &stack);
+    }
+
+    while (stack.n_paths > 0) {
+        char *path = stack.paths[--stack.n_paths];
+        if (!scan_dir(scanner, path, &stack)) {
+            printf("error | Could not read the folder %s\n", path);
+            scanner->n_errors++;
+        }
+        free(path);
+    }
+    free(stack.paths);
+
+    pthread_mutex_lock(&scan->mutex);
+    scan->n_scanners_running--;
+    pthread_cond_broadcast(&scan->cond_has_file);
+    pthread_mutex_unlock(&scan->mutex);
+
+    return NULL;
+}
+
+
+/*!
+  Starts a scanner thread for each of the `n_src_dirs` src dirs. Returns false if we
+  couldn't allocate what we needed or couldn't start the threads.
+  */
+static bool
+init_scan(
+    struct scan *scan, struct src_dir *src_dirs, size_t const n_src_dirs,
+    bool const is_recursive, struct run const *run
+) {
+    *scan = (struct scan){.is_recursive = is_recursive, .stats = run->stats};
+    pthread_mutex_init(&scan->mutex, NULL);
+    pthread_cond_init(&scan->cond_has_file, NULL);
+    pthread_cond_init(&scan->cond_has_room, NULL);
+
+    if (!mark_target_dirs_visited(&scan->target_dirs, &scan->visited_dirs, run)) {
+        return false;
+    }
+
+    // Enough to keep the main thread busy while the scanners are opening folders
+    scan->n_slots = 256;
+    scan->queue = (struct scanned_file*)malloc(scan->n_slots * sizeof(struct scanned_file));
+    scan->scanners = (struct scanner*)calloc(n_src_dirs, sizeof(struct scanner));
+    if (!scan->queue || !scan->scanners) {
+        return false;
+    }
+
+    for (size_t idx = 0; idx < n_src_dirs; idx++) {
+        struct scanner *scanner = &scan->scanners[idx];
+        scanner->scan = scan;
+        scanner->src_dir = &src_dirs[idx];
+        scan->n_scanners++;
+        pthread_mutex_lock(&scan->mutex);
+        scan->n_scanners_running++;
+        pthread_mutex_unlock(&scan->mutex);
+        if (pthread_create(&scanner->thread, NULL, run_scanner, scanner) != 0) {
+            pthread_mutex_lock(&scan->mutex);
+            scan->n_scanners_running--;
+            pthread_mutex_unlock(&scan->mutex);
+            return false;
+        }
+        scanner->is_running = true;
+    }
+
+    return true;
+}
+
+
+/*!
+  Waits for the scanner threads to stop, adds up their stats, then frees everything.
+  If we're stopping early, the queue might still have files in it, so we empty it to
+  let them finish. Also cleans up after an `init_scan()` that failed halfway through.
+  */
+static void
+finish_scan(struct scan *scan)
+{
+    struct scanned_file scanned_file;
+    if (scan->queue) {
+        while (pop_scanned_file(scan, &scanned_file)) {}
+    }
+
+    for (size_t idx = 0; idx < scan->n_scanners; idx++) {
+        struct scanner *scanner = &scan->scanners[idx];
+        if (scanner->is_running) {
+            pthread_join(scanner->thread, NULL);
+        }
+        if (scan->stats) {
+            merge_phase_stats(&scan->stats->phases[PHASE_SCAN], &scanner->scan_stats);
+            scan->stats->n_errors += scanner->n_errors;
+        }
+    }
+
+    free_hash_index(&scan->visited_dirs);
+    free_hash_index(&scan->target_dirs);
+    free(scan->scanners);
+    free(scan->queue);
+    pthread_cond_destroy(&scan->cond_has_room);
+    pthread_cond_destroy(&scan->cond_has_file);
+    pthread_mutex_destroy(&scan->mutex);
+}
+
+
+/*!
+  Goes through every file in `src_dirs` in whatever order the filesystem gives them
+  to us, handling each one on this thread as soon as one of the scanners has found it.
+  */
+static bool
+scan_src_dirs(
+    struct run *run, struct src_dir *src_dirs, size_t const n_src_dirs,
+    bool const is_recursive
+) {
+    struct scan scan;
+    if (!init_scan(&scan, src_dirs, n_src_dirs, is_recursive, run)) {
+        finish_scan(&scan);
+        return false;
+    }
+
+    struct scanned_file scanned_file;
+    while (pop_scanned_file(&scan, &scanned_file)) {
+        handle_file(run, scanned_file.src_dir, &scanned_file.file);
+    }
+
+    finish_scan(&scan);
+    return true;
+}
+
+
+static int
+compare_names(void const *a, void const *b)
+{
+    return strcmp(*(char const * const *)a, *(char const * const *)b);
+}
+
+
+/*!
+  Goes through every file in `dir_path`, which is `src_dir` or one of its subfolders,
+  sorted by name. If `visited_dirs` isn't NULL, we go into subfolders too, as we get to
+  them, so everything comes out in the same order every time.
+
+  We don't use `tinydir_open_sorted()`, because it `stat()`s every file and keeps a
+  whole `tinydir_file` for each of them, which takes up gigabytes for big folders.
+  Instead, we only keep the names, packed one after another, and only look at each
+  file once we get to it. If we're keeping stats, we time reading and sorting the
+  names, and looking at each file, but not handling the files or the subfolders.
+  */
+static bool
+scan_dir_sorted(
+    struct run *run, struct src_dir *src_dir, char const *dir_path,
+    struct hash_index *visited_dirs
+) {
+    bool did_succeed = false;
+    char *names = NULL;
+    size_t names_len = 0;
+    size_t names_cap = 0;
+    size_t *name_offsets = NULL;
+    char **sorted_names = NULL;
+    size_t n_names = 0;
+    size_t n_names_cap = 0;
+    struct timing timing = {};
+    struct stopwatch stopwatch;
+    start_stopwatch(&stopwatch, run->stats != NULL);
+
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        goto cleanup_return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        size_t const name_size = pstr_len(entry->d_name) + 1;
+        if (names_len + name_size > names_cap) {
+            names_cap = (names_cap + name_size) * 2;
+            char *new_names = (char*)realloc(names, names_cap);
+            if (!new_names) {
+                goto cleanup_closedir;
+            }
+            names = new_names;
+        }
+        if (n_names == n_names_cap) {
+            n_names_cap = n_names_cap ? n_names_cap * 2 : 1024;
+            size_t *new_name_offsets = (size_t*)realloc(name_offsets,
+                n_names_cap * sizeof(size_t));
+            if (!new_name_offsets) {
+                goto cleanup_closedir;
+            }
+            name_offsets = new_name_offsets;
+        }
+        memcpy(names + names_len, entry->d_name, name_size);
+        name_offsets[n_names++] = names_len;
+        names_len += name_size;
+    }
+
+    // We've got all the names, so we don't need to keep the folder open while we go
+    // into subfolders
+    closedir(dir);
+    dir = NULL;
+
+    // `names` might have moved while it was growing, so we only make pointers now
+    sorted_names = (char**)malloc((n_names ? n_names : 1) * sizeof(char*));
+    if (!sorted_names) {
+        goto cleanup_return;
+    }
+    for (size_t idx = 0; idx < n_names; idx++) {
+        sorted_names[idx] = names + name_offsets[idx];
+    }
+    free(name_offsets);
+    name_offsets = NULL;
+    qsort(sorted_names, n_names, sizeof(char*), compare_names);
+    stop_stopwatch(&stopwatch, &timing);
+
+    uint64_t n_errors = 0;
+    for (size_t idx = 0; idx < n_names; idx++) {
+        tinydir_file file = {};
+        if (
+            !pstr_vcat(file.path, sizeof(file.path), dir_path, "/", sorted_names[idx], NULL) ||
+            !pstr_copy(file.name, sizeof(file.name), sorted_names[idx])
+        ) {
+            printf("error | Your file paths are too long, so we couldn't move %s.\n",
+                sorted_names[idx]);
+            n_errors++;
+            continue;
+        }
+        start_stopwatch(&stopwatch, stopwatch.is_on);
+        int const stat_result = stat(file.path, &file._s);
+        stop_stopwatch(&stopwatch, &timing);
+        if (stat_result != 0) {
+            printf("error | Could not open file %s\n", file.path);
+            n_errors++;
+            continue;
+        }
+        file.is_dir = S_ISDIR(file._s.st_mode);
+        file.is_reg = S_ISREG(file._s.st_mode);
+        if (!file.is_dir) {
+            _tinydir_get_ext(&file);
+            handle_file(run, src_dir, &file);
+        } else if (visited_dirs && mark_dir_visited(visited_dirs, &file._s)) {
+            if (!scan_dir_sorted(run, src_dir, file.path, visited_dirs)) {
+                printf("error | Could not read the folder %s\n", file.path);
+                n_errors++;
+            }
+        }
+    }
+
+    if (run->stats) {
+        add_phase_sample(&run->stats->phases[PHASE_SCAN], &timing);
+        run->stats->n_errors += n_errors;
+    }
+    did_succeed = true;
+
+cleanup_closedir:
+    if (dir) {
+        closedir(dir);
+    }
+cleanup_return:
+    free(sorted_names);
+    free(name_offsets);
+    free(names);
+    return did_succeed;
+}
+
+
+/*!
+  Goes through every file in `src_dirs`, one src dir after another, sorted by name.
+  */
+static bool
+scan_src_dirs_sorted(
+    struct run *run, struct src_dir *src_dirs, size_t const n_src_dirs,
+    bool const is_recursive
+) {
+    bool did_succeed = false;
+    struct hash_index visited_dirs = {};
+    struct hash_index target_dirs = {};
+    if (!mark_target_dirs_visited(&target_dirs, &visited_dirs, run)) {
+        goto cleanup_return;
+    }
+
+    for (size_t idx = 0; idx < n_src_dirs; idx++) {
+        struct src_dir *src_dir = &src_dirs[idx];
+        struct stat st;
+        if (stat(src_dir->path, &st) != 0) {
+            continue;
+        }
+        bool const is_target_dir = is_in_hash_index(&target_dirs, get_dir_id(&st));
+        // If this src dir is inside another one, we've read it already
+        src_dir->could_scan = (!mark_dir_visited(&visited_dirs, &st) && !is_target_dir) ||
+            scan_dir_sorted(run, src_dir, src_dir->path,
+                is_recursive && !is_target_dir ? &visited_dirs : NULL);
+    }
+    did_succeed = true;
+
+cleanup_return:
+    free_hash_index(&visited_dirs);
+    free_hash_index(&target_dirs);
+    return did_succeed;
+}
+
+
+#if !defined(FOTOGRAFISKA_NO_MAIN)
+struct src_dir_list {
+    struct src_dir *dirs;
+    size_t n_dirs;
+};
+
+
+static double
+ns_to_s(uint64_t const ns)
+{
+    return (double)ns / 1e9;
+}
+
+
+static double
+get_rate(uint64_t const n, uint64_t const ns)
+{
+    return ns > 0 ? (double)n / ns_to_s(ns) : 0.0;
+}
+
+
+/*!
+  Prints `stats` as a few lines of text, for people to read.
+  */
+static void
+print_stats_text(struct stats const *stats)
+{
+    uint64_t const wall_ns = stats->run_timing.wall_ns;
+    printf("Stats: %" PRIu64 " files in %.3fs (%.1f files/s, %.1f MB/s), %.3fs CPU, "
+        "%.3fs getting ready\n",
+        stats->n_files, ns_to_s(wall_ns), get_rate(stats->n_files, wall_ns),
+        get_rate(stats->n_bytes_read, wall_ns) / MB_TO_B(1), ns_to_s(stats->run_timing.cpu_ns),
+        ns_to_s(stats->setup_timing.wall_ns));
+    printf("Stats: %" PRIu64 " bytes read, %" PRIu64 " files from the cache, "
+        "%" PRIu64 " dates from the file itself, %" PRIu64 " from the modification time\n",
+        stats->n_bytes_read, stats->n_cached, stats->n_embedded_dates, stats->n_mtime_dates);
+    printf("Stats: %" PRIu64 " moved, %" PRIu64 " duplicates, %" PRIu64 " already there, "
+        "%" PRIu64 " errors\n",
+        stats->n_moved, stats->n_duplicates, stats->n_already_there, stats->n_errors);
+    printf("Stats: %-5s %9s %10s %10s %10s %10s %10s %10s\n",
+        "phase", "count", "wall s", "cpu s", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (size_t idx = 0; idx < N_PHASES; idx++) {
+        struct phase_stats const *phase = &stats->phases[idx];
+        printf("Stats: %-5s %9" PRIu64 " %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+            PHASE_NAMES[idx], phase->n_samples, ns_to_s(phase->wall_ns),
+            ns_to_s(phase->cpu_ns),
+            get_latency_percentile(phase, 50) / 1e6,
+            get_latency_percentile(phase, 90) / 1e6,
+            get_latency_percentile(phase, 99) / 1e6,
+            phase->max_ns / 1e6);
+    }
+}
+
+
+/*!
+  Prints `stats` as a JSON object, for scripts to read. It always starts with a line
+  that is just `{`, so it's easy to find after everything else we print. Times are in
+  seconds, apart from latencies, which are in microseconds.
+  */
+static void
+print_stats_json(struct stats const *stats, bool const is_dry_run)
+{
+    uint64_t const wall_ns = stats->run_timing.wall_ns;
+    printf("{\n");
+    printf("  \"dry_run\": %s,\n", is_dry_run ? "true" : "false");
+    printf("  \"wall_s\": %.6f,\n", ns_to_s(wall_ns));
+    printf("  \"cpu_s\": %.6f,\n", ns_to_s(stats->run_timing.cpu_ns));
+    printf("  \"setup_s\": %.6f,\n", ns_to_s(stats->setup_timing.wall_ns));
+    printf("  \"files\": %" PRIu64 ",\n", stats->n_files);
+    printf("  \"bytes_read\": %" PRIu64 ",\n", stats->n_bytes_read);
+    printf("  \"files_per_s\": %.3f,\n", get_rate(stats->n_files, wall_ns));
+    printf("  \"mb_per_s\": %.3f,\n", get_rate(stats->n_bytes_read, wall_ns) / MB_TO_B(1));
+    printf("  \"cached\": %" PRIu64 ",\n", stats->n_cached);
+    printf("  \"dates\": {\"embedded\": %" PRIu64 ", \"mtime\": %" PRIu64 "},\n",
+        stats->n_embedded_dates, stats->n_mtime_dates);
+    printf("  \"outcomes\": {\"moved\": %" PRIu64 ", \"duplicates\": %" PRIu64 ", "
+        "\"already_there\": %" PRIu64 ", \"errors\": %" PRIu64 "},\n",
+        stats->n_moved, stats->n_duplicates, stats->n_already_there, stats->n_errors);
+    printf("  \"phases\": {\n");
+    for (size_t idx = 0; idx < N_PHASES; idx++) {
+        struct phase_stats const *phase = &stats->phases[idx];
+        printf("    \"%s\": {\"count\": %" PRIu64 ", \"wall_s\": %.6f, \"cpu_s\": %.6f, "
+            "\"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}}%s\n",
+            PHASE_NAMES[idx], phase->n_samples, ns_to_s(phase->wall_ns),
+            ns_to_s(phase->cpu_ns),
+            get_latency_percentile(phase, 50) / 1e3,
+            get_latency_percentile(phase, 90) / 1e3,
+            get_latency_percentile(phase, 99) / 1e3,
+            phase->max_ns / 1e3,
+            idx + 1 < N_PHASES ? "," : "");
+    }
+    printf("  }\n");
+    printf("}\n");
+}
+
+
+/*!
+  Finishes timing the run, which started at `wall_start_ns` and `cpu_start_ns`, and
+  prints `stats` in `format`, which is text or json.
+  */
+static void
+print_stats(
+    struct stats *stats, char const *format, bool const is_dry_run,
+    uint64_t const wall_start_ns, uint64_t const cpu_start_ns
+) {
+    stats->run_timing = (struct timing){
+        .is_set = true,
+        .wall_ns = get_time_ns(CLOCK_MONOTONIC) - wall_start_ns,
+        .cpu_ns = get_time_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start_ns,
+    };
+    if (pstr_eq(format, "json")) {
+        print_stats_json(stats, is_dry_run);
+    } else {
+        print_stats_text(stats);
+    }
+}
+
+
+/*!
+  Called by argparse for each `--src-dir`, so that it can be given more than once.
+  */
+static int
+add_src_dir(struct argparse *self, struct argparse_option const *option)
+{
+    (void)self;
+    struct src_dir_list *list = (struct src_dir_list*)option->data;
+    struct src_dir *new_dirs = (struct src_dir*)realloc(list->dirs,
+        (list->n_dirs + 1) * sizeof(struct src_dir));
+    if (!new_dirs) {
+        printf("error | Not enough memory to remember all the source directories.\n");
+        exit(EXIT_FAILURE);
+    }
+    list->dirs = new_dirs;
+    list->dirs[list->n_dirs++] = (struct src_dir){
+        .path = *(char const **)option->value,
+    };
+    return 0;
+}
+
+
+/*!
+  Runs fotografiska with commandline arguments.
+  See top of the file for arguments.
+  */
+int
+main(int argc, const char **argv)
+{
+    struct stat st;
+    char const *src_dir = NULL;
+    struct src_dir_list src_dirs = {};
+    char *dest_dir = NULL;
+    char *duplicates_dir = NULL;
+    char const *hash_name = HASH_KIND_NAMES[HASH_XXH64];
+    char const *stats_format = NULL;
+    // argparse stores booleans as `int`s
+    int is_dry_run = false;
+    int should_use_journal = false;
+    int is_plan_only = false;
+    int is_quiet = false;
+    int is_sorted = false;
+    int is_recursive = false;
+    int is_cache_disabled = false;
+    int should_skip_duplicates = false;
+    int should_use_io_uring = false;
+    int n_jobs = 1;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_STRING('i', "src-dir", &src_dir, "a folder containing images/videos to read from (can be given more than once)", add_src_dir, (intptr_t)&src_dirs),
+        OPT_STRING('o', "dest-dir", &dest_dir, "a folder to move the files from src-dir into"),
+        OPT_BOOLEAN('d', "dry-run", &is_dry_run, "don't move files, just print out what would be done"),
+        OPT_INTEGER('j', "jobs", &n_jobs, "how many files to read and hash at once (0 means one per CPU core)"),
+        OPT_BOOLEAN('r', "recursive", &is_recursive, "also read files in folders inside src-dir"),
+        OPT_BOOLEAN('s', "sorted", &is_sorted, "go through files sorted by name, rather than in whatever order they're found"),
+        OPT_BOOLEAN(0, "skip-duplicates", &should_skip_duplicates, "don't move files whose contents are already in dest-dir, even under a different name"),
+        OPT_STRING(0, "duplicates-dir", &duplicates_dir, "like --skip-duplicates, but move duplicates into this folder instead of leaving them"),
+        OPT_BOOLEAN(0, "no-cache", &is_cache_disabled, "don't remember files we've read in dest-dir, and don't use what we remembered last time"),
+        OPT_STRING(0, "hash", &hash_name, "how to hash files for their names: xxh64 (the default), xxh3-64 or xxh3-128 of the first 10MB, sampled (xxh3-128 of the start, end and size) or full (xxh3-128 of the whole file)"),
+        OPT_BOOLEAN(0, "io-uring", &should_use_io_uring, "read and move lots of files at once with io_uring, if the kernel supports it (otherwise --jobs is used)"),
+        OPT_BOOLEAN('q', "quiet", &is_quiet, "don't print a line for every file, only errors and files that are already there"),
+        OPT_STRING(0, "stats", &stats_format, "at the end, print how long each part of the run took, and what happened to the files, as text or json"),
+        OPT_BOOLEAN(0, "journal", &should_use_journal, "plan what to do with every file and write it down in dest-dir before moving anything, so an interrupted run can carry on where it left off"),
+        OPT_BOOLEAN(0, "plan-only", &is_plan_only, "like --journal, but stop once everything's planned, so the next run carries out the plan"),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, USAGE_PARTS, 0);
+    argparse_describe(&argparse, USAGE_BODY, USAGE_EPILOGUE);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (!dest_dir || n_jobs < 0) {
+        argparse_usage(&argparse);
+        return 1;
+    }
+
+    if (is_dry_run && (should_use_journal || is_plan_only)) {
+        printf("--dry-run can't be used with --journal or --plan-only.\n");
+        argparse_usage(&argparse);
+        return 1;
+    }
+
+    enum hash_kind hash_kind = HASH_XXH64;
+    if (!parse_hash_kind(hash_name, &hash_kind)) {
+        printf("Unknown hash: %s\n", hash_name);
+        argparse_usage(&argparse);
+        return 1;
+    }
+
+    bool const is_stats_format_valid = !stats_format ||
+        pstr_eq(stats_format, "text") || pstr_eq(stats_format, "json");
+    if (!is_stats_format_valid) {
+        printf("Unknown stats format: %s\n", stats_format);
+        argparse_usage(&argparse);
+        return 1;
+    }
+
+    // Everything from here on counts towards the run's stats
+    struct stats stats = {};
+    uint64_t const run_wall_start_ns = get_time_ns(CLOCK_MONOTONIC);
+    uint64_t const run_cpu_start_ns = get_time_ns(CLOCK_PROCESS_CPUTIME_ID);
+    struct stopwatch setup_stopwatch;
+    start_stopwatch(&setup_stopwatch, stats_format != NULL);
+
+    if (n_jobs == 0) {
+#if defined(_WIN32)
+        SYSTEM_INFO system_info;
+        GetSystemInfo(&system_info);
+        long const n_cores = system_info.dwNumberOfProcessors;
+#else
+        long const n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        n_jobs = n_cores > 0 ? (int)n_cores : 1;
+    }
+
+    pstr_rtrim_char(dest_dir, '/');
+
+    for (size_t idx = 0; idx < src_dirs.n_dirs; idx++) {
+        if (stat(src_dirs.dirs[idx].path, &st) != 0) {
+            printf("Source directory %s does not exist.\n", src_dirs.dirs[idx].path);
+            return 1;
+        }
+    }
+
+    if (stat(dest_dir, &st) != 0) {
+        printf("Destination directory does not exist.\n");
+        return 1;
+    }
+
+    // If there's a plan we haven't finished carrying out, we'll do that instead of
+    // reading the source directories
+    struct journal journal;
+    if (!load_journal(&journal, dest_dir)) {
+        printf("error | Could not read the plan in %s/%s. If you don't need it any more, "
+            "delete it and try again.\n", dest_dir, JOURNAL_FILE_NAME);
+        free_journal(&journal);
+        return 1;
+    }
+    if (journal.is_started && is_plan_only) {
+        printf("There's already a plan in %s. Run fotografiska without --plan-only to "
+            "carry it out first.\n", journal.path);
+        free_journal(&journal);
+        return 1;
+    }
+    if (!journal.is_started && src_dirs.n_dirs == 0) {
+        argparse_usage(&argparse);
+        return 1;
+    }
+
+    if (duplicates_dir) {
+        pstr_rtrim_char(duplicates_dir, '/');
+        if (stat(duplicates_dir, &st) != 0) {
+            printf("Duplicates directory does not exist.\n");
+            return 1;
+        }
+    }
+
+    struct run run = {
+        .dest_dir = dest_dir,
+        .is_dry_run = is_dry_run,
+        .is_quiet = is_quiet,
+        .hash_kind = hash_kind,
+        .stats = stats_format ? &stats : NULL,
+    };
+
+    if (!open_target_dir(&run.dest_dir_target, dest_dir)) {
+        printf("error | Could not open the destination directory.\n");
+        return 1;
+    }
+
+    if (journal.is_started) {
+        if (src_dirs.n_dirs > 0) {
+            printf("There's an unfinished plan in %s, so we'll carry that out instead of "
+                "reading the source directories.\n", journal.path);
+        }
+        stop_stopwatch(&setup_stopwatch, &stats.setup_timing);
+        bool const could_carry_out = carry_out_journal(&run, &journal);
+        free_journal(&journal);
+        close_target_dir(&run.dest_dir_target);
+        free(src_dirs.dirs);
+        if (run.stats) {
+            print_stats(&stats, stats_format, is_dry_run, run_wall_start_ns, run_cpu_start_ns);
+        }
+        return could_carry_out ? EXIT_SUCCESS : 1;
+    }
+
+    if (should_use_journal || is_plan_only) {
+        if (!start_journal(&journal, dest_dir, duplicates_dir)) {
+            printf("error | Could not start a journal in %s.\n", journal.path);
+            free_journal(&journal);
+            return 1;
+        }
+        run.journal = &journal;
+    }
+
+    struct cache cache;
+    if (!is_cache_disabled) {
+        if (!load_cache(&cache, dest_dir)) {
+            printf("error | Could not read the cache, so we'll start a new one.\n");
+        }
+        run.cache = &cache;
+    }
+
+    struct hash_index index;
+    if (should_skip_duplicates || duplicates_dir) {
+        printf("Looking for files in %s\n", dest_dir);
+        if (!build_hash_index(&index, dest_dir)) {
+            printf("error | Could not read the files in %s to look for duplicates.\n", dest_dir);
+            free_hash_index(&index);
+            return 1;
+        }
+        printf("%s: %zu unique files\n", dest_dir, index.n_hashes + index.has_zero);
+        run.index = &index;
+    }
+
+    struct target_dir duplicates_target;
+    if (duplicates_dir) {
+        if (!open_target_dir(&duplicates_target, duplicates_dir)) {
+            printf("error | Could not open the duplicates directory.\n");
+            return 1;
+        }
+        run.duplicates_dir = &duplicates_target;
+    }
+
+#if defined(CAN_USE_IO_URING)
+    struct uring_engine uring;
+    if (should_use_io_uring) {
+        if (init_uring_engine(&uring, &run)) {
+            run.uring = &uring;
+        } else {
+            free_uring_engine(&uring);
+        }
+    }
+#endif
+    if (should_use_io_uring && !run.uring) {
+        printf("io_uring isn't supported here, so we'll read files the usual way.\n");
+    }
+
+    struct worker_pool pool;
+    if (n_jobs > 1 && !run.uring) {
+        if (!init_worker_pool(&pool, n_jobs, &run)) {
+            printf("error | Could not start %d worker threads.\n", n_jobs);
+            finish_worker_pool(&pool);
+            return 1;
+        }
+        run.pool = &pool;
+    }
+
+    stop_stopwatch(&setup_stopwatch, &stats.setup_timing);
+
+    for (size_t idx = 0; idx < src_dirs.n_dirs; idx++) {
+        printf("Reading files from %s\n", src_dirs.dirs[idx].path);
+    }
+
+    // Go through over every file in the directories, and try to put it in the right place
+    bool const could_scan = is_sorted ?
+        scan_src_dirs_sorted(&run, src_dirs.dirs, src_dirs.n_dirs, is_recursive) :
+        scan_src_dirs(&run, src_dirs.dirs, src_dirs.n_dirs, is_recursive);
+
+#if defined(CAN_USE_IO_URING)
+    if (run.uring) {
+        finish_uring_engine(run.uring);
+    }
+#endif
+    if (run.pool) {
+        finish_worker_pool(run.pool);
+    }
+
+    free(run.file_buffer);
+
+    bool could_carry_out = true;
+    if (run.journal) {
+        if (!finish_journal_plan(&journal)) {
+            printf("error | Could not finish writing the plan in %s.\n", journal.path);
+            could_carry_out = false;
+        }
+        printf("Planned %" PRIu64 " files in %s\n", journal.n_moves, journal.path);
+    }
+
+    if (run.cache) {
+        printf("Cache: %zu hits, %zu misses\n", cache.n_hits, cache.n_misses);
+        // A dry run shouldn't leave anything behind in the destination dir
+        if (!is_dry_run && !save_cache(&cache)) {
+            printf("error | Could not save the cache to %s\n", cache.path);
+        }
+        free_cache(&cache);
+    }
+
+    if (run.index) {
+        free_hash_index(&index);
+    }
+
+    if (run.journal && is_plan_only) {
+        printf("Run fotografiska again with the same --dest-dir to carry out the plan.\n");
+        free_journal(&journal);
+    } else if (run.journal) {
+        // Load what we've just written, exactly as if we'd been interrupted
+        free_journal(&journal);
+        if (!load_journal(&journal, dest_dir)) {
+            printf("error | Could not read back the plan in %s/%s.\n", dest_dir,
+                JOURNAL_FILE_NAME);
+            could_carry_out = false;
+        } else if (journal.is_started && !carry_out_journal(&run, &journal)) {
+            could_carry_out = false;
+        }
+        free_journal(&journal);
+    }
+
+    if (run.duplicates_dir) {
+        close_target_dir(run.duplicates_dir);
+    }
+    close_target_dir(&run.dest_dir_target);
+
+    if (!could_scan) {
+        printf("error | Could not start reading the source directories.\n");
+        free(src_dirs.dirs);
+        return 1;
+    }
+
+    bool could_scan_all = true;
+    for (size_t idx = 0; idx < src_dirs.n_dirs; idx++) {
+        struct src_dir const *src_dir = &src_dirs.dirs[idx];
+        if (!src_dir->could_scan) {
+            printf("error | Could not read the source directory %s.\n", src_dir->path);
+            could_scan_all = false;
+            stats.n_errors++;
+        } else {
+            printf("%s: %zu files\n", src_dir->path, src_dir->n_files);
+        }
+    }
+    free(src_dirs.dirs);
+
+    if (run.stats) {
+        print_stats(&stats, stats_format, is_dry_run, run_wall_start_ns, run_cpu_start_ns);
+    }
+
+    return could_scan_all && could_carry_out ? EXIT_SUCCESS : 1;
+}
+#endif